@@ -1,11 +1,17 @@
 /* Test support code */
 
+/* For dladdr() */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -30,34 +36,57 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Allocated blocks are registered in open-addressing hash sets with linear
+ * probing, so that adding, finding and removing a block all take constant
+ * expected time however many blocks are live. Blocks are spread over
+ * REGISTRY_SHARDS sets by address, each behind its own lock, so that threads
+ * allocating at the same time seldom wait for each other.
+ */
+#define REGISTRY_MIN_SIZE 1024
+#define REGISTRY_SHARD_BITS 4
+#define REGISTRY_SHARDS (1 << REGISTRY_SHARD_BITS)
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_element_t **slot; /* NULL marks an empty slot */
+    size_t mask;            /* Number of slots minus one */
+    size_t count;           /* Number of blocks registered */
+} registry_t;
+
+static registry_t registry[REGISTRY_SHARDS];
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Number of freed blocks each thread holds back from reuse, 0 for none */
+int quarantine_size = 0;
+
+/* Whether allocations are recorded for alloc_profile_report() */
+int alloc_profile = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
+/* Set from any thread, so only accessed through the __atomic builtins */
 static bool error_occurred = false;
-static char *error_message = "";
 
-static int time_limit = 1;
+/* Seconds a risky operation may run before it is interrupted */
+int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, kept per thread so that an exception never
+ * unwinds into the stack of another thread
+ */
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread char *error_message = "";
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -74,32 +103,585 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Registry shard that block b belongs to, taken from the low bits of its
+ * page number so that consecutive pages go round the shards
+ */
+static registry_t *registry_of(const block_element_t *b)
+{
+    return &registry[((uintptr_t) b >> 12) % REGISTRY_SHARDS];
+}
+
+/* Home slot of block b in registry shard r */
+static size_t registry_home(const registry_t *r, const block_element_t *b)
+{
+    /* Blocks are 16-byte aligned. Blocks next to each other in the heap
+     * land in nearby slots, which keeps freeing a queue in allocation order
+     * cache friendly, while folding in the page number spreads blocks that
+     * all start on a page boundary. The page number bits that picked the
+     * shard are dropped first, so each shard sees a dense run of pages.
+     */
+    uintptr_t a = (uintptr_t) b;
+    a = (a >> (12 + REGISTRY_SHARD_BITS) << 12) | (a & 0xfff);
+    return (size_t) ((a >> 4) ^ (a >> 12)) & r->mask;
+}
+
+/* Slot holding block b in shard r, or the empty slot ending its probe */
+static size_t registry_slot(const registry_t *r, const block_element_t *b)
+{
+    size_t i = registry_home(r, b);
+    while (r->slot[i] && r->slot[i] != b)
+        i = (i + 1) & r->mask;
+    return i;
+}
+
+/* Rehash shard r into size slots, a power of two */
+static bool registry_resize(registry_t *r, size_t size)
+{
+    block_element_t **old = r->slot;
+    size_t old_size = old ? r->mask + 1 : 0;
+
+    r->slot = calloc(size, sizeof(block_element_t *));
+    if (!r->slot) {
+        r->slot = old;
+        return false;
+    }
+    r->mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i])
+            r->slot[registry_slot(r, old[i])] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Register block b, keeping its shard at most half full */
+static bool registry_add(block_element_t *b)
+{
+    registry_t *r = registry_of(b);
+    bool ok = true;
+    pthread_mutex_lock(&r->lock);
+    if (!r->slot || 2 * (r->count + 1) > r->mask + 1)
+        ok = registry_resize(r, r->slot ? 2 * (r->mask + 1)
+                                        : REGISTRY_MIN_SIZE);
+    if (ok) {
+        r->slot[registry_slot(r, b)] = b;
+        r->count++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ok;
+}
+
+/* Unregister block b. Return false if it was not registered */
+static bool registry_remove(const block_element_t *b)
+{
+    registry_t *r = registry_of(b);
+    pthread_mutex_lock(&r->lock);
+    size_t i = r->slot ? registry_slot(r, b) : 0;
+    if (!r->slot || !r->slot[i]) {
+        pthread_mutex_unlock(&r->lock);
+        return false;
+    }
+
+    /* Shift later blocks of the probe sequence back instead of leaving a
+     * tombstone, moving each one that may not be probed past the hole
+     */
+    r->slot[i] = NULL;
+    for (size_t j = (i + 1) & r->mask; r->slot[j]; j = (j + 1) & r->mask) {
+        size_t home = registry_home(r, r->slot[j]);
+        if (((j - home) & r->mask) >= ((j - i) & r->mask)) {
+            r->slot[i] = r->slot[j];
+            r->slot[j] = NULL;
+            i = j;
+        }
+    }
+    r->count--;
+
+    /* Give the slots back once every block has been freed */
+    if (!r->count && r->mask + 1 > REGISTRY_MIN_SIZE) {
+        free(r->slot);
+        r->slot = NULL;
+        r->mask = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+/* Blocks of up to SLAB_MAX_BLOCK bytes, header and footer included, are
+ * carved from page-sized slabs in a few size classes, each with a free list
+ * of the blocks that have been freed. Every thread allocates from a cache of
+ * its own, which holds its free lists, the slab it is carving and its count
+ * of blocks. A block freed by another thread joins the free list of that
+ * thread. The cache of a thread that exits is taken over by the next thread
+ * that starts allocating. Slabs are only given back once allocation_check()
+ * finds that every block has been freed.
+ *
+ * Building with HARNESS_NO_SLABS, as SANITIZER=1 and make valgrind do, sends
+ * every block to malloc so that those tools can track each one on its own.
+ */
+#define SLAB_SIZE 4096
+#ifdef HARNESS_NO_SLABS
+#define SLAB_MAX_BLOCK 0
+#else
+#define SLAB_MAX_BLOCK 256
+#endif
+#define SLAB_CLASSES 7
+
+static const size_t slab_class_size[SLAB_CLASSES] = {32,  48,  64, 96,
+                                                      128, 192, 256};
+
+typedef struct __slab {
+    struct __slab *next;
+    size_t pad; /* Keeps the blocks 16-byte aligned */
+    unsigned char blocks[0];
+} slab_t;
+
+typedef struct __block_cache {
+    struct __block_cache *next; /* Next in the list of all caches */
+    bool owned;                 /* Whether a live thread uses this cache */
+    /* Blocks allocated minus blocks freed by its threads, and the same for
+     * payload bytes. Only the owner changes them but any thread sums them,
+     * so see cache_account().
+     */
+    long count;
+    long bytes;
+    struct {
+        block_element_t *free_list;  /* Linked through the first payload word */
+        unsigned char *cursor, *end; /* Not yet used part of the newest slab */
+    } slab_class[SLAB_CLASSES];
+    /* Ring of the freed blocks in quarantine, oldest first. The newest
+     * quarantine_fresh of them are not poisoned yet.
+     */
+    block_element_t **quarantine;
+    size_t quarantine_cap, quarantine_first, quarantine_len;
+    size_t quarantine_fresh;
+} block_cache_t;
+
+/* Guards the list of caches and the list of slabs */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_cache_t *caches = NULL;
+static slab_t *slabs = NULL;
+
+static __thread block_cache_t *local_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t harness_once = PTHREAD_ONCE_INIT;
+
+/* Add count blocks and bytes payload bytes to the cache of this thread.
+ * Other threads only read the totals, so plain atomic stores will do.
+ */
+static inline void cache_account(block_cache_t *cache, long count, long bytes)
+{
+    __atomic_store_n(&cache->count, cache->count + count, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->bytes, cache->bytes + bytes, __ATOMIC_RELAXED);
+}
+
+/* Hand the cache of an exiting thread over to the next new thread */
+static void cache_retire(void *cache)
+{
+    pthread_mutex_lock(&cache_lock);
+    ((block_cache_t *) cache)->owned = false;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Payload of a block in quarantine, once poisoned */
+static unsigned char poison[256];
+
+static void harness_init()
+{
+    memset(poison, FILLCHAR, sizeof(poison));
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
+        pthread_mutex_init(&registry[i].lock, NULL);
+    pthread_key_create(&cache_key, cache_retire);
+}
+
+/* Cache of the calling thread, or NULL if none could be allocated */
+static block_cache_t *thread_cache()
+{
+    if (local_cache)
+        return local_cache;
+
+    pthread_once(&harness_once, harness_init);
+    pthread_mutex_lock(&cache_lock);
+    block_cache_t *c = caches;
+    while (c && c->owned)
+        c = c->next;
+    if (!c) {
+        c = calloc(1, sizeof(block_cache_t));
+        if (c) {
+            c->next = caches;
+            caches = c;
+        }
+    }
+    if (c)
+        c->owned = true;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (c) {
+        pthread_setspecific(cache_key, c);
+        local_cache = c;
+    }
+    return c;
+}
+
+/* Size class of a block of size bytes, or -1 if it is not kept in slabs */
+static int slab_class_of(size_t size)
+{
+    if (size > SLAB_MAX_BLOCK)
+        return -1;
+    int c = 0;
+    while (slab_class_size[c] < size)
+        c++;
+    return c;
+}
+
+/* Get a block of size bytes from cache */
+static block_element_t *slab_alloc(block_cache_t *cache, size_t size)
+{
+    int c = slab_class_of(size);
+    if (c < 0)
+        return malloc(size);
+
+    block_element_t *b = cache->slab_class[c].free_list;
+    if (b) {
+        cache->slab_class[c].free_list = *(block_element_t **) b->payload;
+        return b;
+    }
+
+    if (cache->slab_class[c].cursor + slab_class_size[c] >
+        cache->slab_class[c].end) {
+        slab_t *slab = malloc(SLAB_SIZE);
+        if (!slab)
+            return NULL;
+        pthread_mutex_lock(&cache_lock);
+        slab->next = slabs;
+        slabs = slab;
+        pthread_mutex_unlock(&cache_lock);
+        cache->slab_class[c].cursor = slab->blocks;
+        cache->slab_class[c].end = (unsigned char *) slab + SLAB_SIZE;
+    }
+    b = (block_element_t *) cache->slab_class[c].cursor;
+    cache->slab_class[c].cursor += slab_class_size[c];
+    return b;
+}
+
+/* Give back block b of size bytes to cache */
+static void slab_free(block_cache_t *cache, block_element_t *b, size_t size)
+{
+    int c = slab_class_of(size);
+    if (c < 0) {
+        free(b);
+        return;
+    }
+    *(block_element_t **) b->payload = cache->slab_class[c].free_list;
+    cache->slab_class[c].free_list = b;
+}
+
+/* Give every slab back and empty every cache. Call with cache_lock held,
+ * once no block is allocated
+ */
+static void slab_release()
+{
+    while (slabs) {
+        slab_t *next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    for (block_cache_t *c = caches; c; c = c->next)
+        memset(c->slab_class, 0, sizeof(c->slab_class));
+}
+
+/* While alloc_profile is set, every allocation is recorded with the address
+ * it was called from, its size and the time into a fixed ring of the latest
+ * PROFILE_RING_SIZE, and added up per call site: number of blocks, bytes
+ * and a histogram of sizes by power of two. Call sites beyond the first
+ * PROFILE_SITES are added up together.
+ */
+#define PROFILE_RING_SIZE 4096
+#define PROFILE_SITES 256 /* A power of two */
+#define PROFILE_BUCKETS 12  /* Up to 1, 2, 4, ..., 1024 bytes and more */
+
+typedef struct {
+    void *caller;
+    size_t size;
+    struct timespec time;
+} alloc_record_t;
+
+typedef struct {
+    void *caller; /* NULL for an unused site */
+    size_t blocks, bytes;
+    size_t histogram[PROFILE_BUCKETS];
+} alloc_site_t;
+
+static struct {
+    pthread_mutex_t lock;
+    alloc_record_t ring[PROFILE_RING_SIZE];
+    size_t recorded; /* Number of allocations ever recorded */
+    alloc_site_t site[PROFILE_SITES];
+    alloc_site_t other; /* Call sites that found the table full */
+    long peak_bytes;    /* Most payload bytes live at once */
+} profile = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Payload bytes allocated and not freed yet, over every thread */
+long allocation_bytes()
+{
+    long bytes = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (block_cache_t *c = caches; c; c = c->next)
+        bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+    return bytes;
+}
+
+/* Entry for caller in the call site table */
+static alloc_site_t *profile_site(void *caller)
+{
+    size_t i = ((uintptr_t) caller >> 2) % PROFILE_SITES;
+    for (size_t n = 0; n < PROFILE_SITES; n++) {
+        alloc_site_t *site = &profile.site[(i + n) % PROFILE_SITES];
+        if (!site->caller)
+            site->caller = caller;
+        if (site->caller == caller)
+            return site;
+    }
+    return &profile.other;
+}
+
+/* Record the allocation of size bytes called from caller */
+static void profile_record(void *caller, size_t size)
+{
+    long bytes = allocation_bytes();
+    pthread_mutex_lock(&profile.lock);
+    alloc_record_t *r = &profile.ring[profile.recorded++ % PROFILE_RING_SIZE];
+    r->caller = caller;
+    r->size = size;
+    clock_gettime(CLOCK_MONOTONIC, &r->time);
+
+    alloc_site_t *site = profile_site(caller);
+    int bucket = 0;
+    while (bucket < PROFILE_BUCKETS - 1 && ((size_t) 1 << bucket) < size)
+        bucket++;
+    site->blocks++;
+    site->bytes += size;
+    site->histogram[bucket]++;
+    if (bytes > profile.peak_bytes)
+        profile.peak_bytes = bytes;
+    pthread_mutex_unlock(&profile.lock);
+}
+
+void alloc_profile_reset()
+{
+    long bytes = allocation_bytes();
+    pthread_mutex_lock(&profile.lock);
+    profile.recorded = 0;
+    memset(profile.site, 0, sizeof(profile.site));
+    memset(&profile.other, 0, sizeof(profile.other));
+    profile.peak_bytes = bytes;
+    pthread_mutex_unlock(&profile.lock);
+}
+
+/* Report one line for call site */
+static void profile_report_site(const alloc_site_t *site)
+{
+    char name[MAX_CHAR];
+    Dl_info info;
+    if (!site->caller) {
+        snprintf(name, sizeof(name), "(other)");
+    } else if (!dladdr(site->caller, &info)) {
+        snprintf(name, sizeof(name), "%p", site->caller);
+    } else if (info.dli_sname) {
+        snprintf(name, sizeof(name), "%s+%#lx", info.dli_sname,
+                 (unsigned long) ((char *) site->caller -
+                                  (char *) info.dli_saddr));
+    } else {
+        /* Static functions have no dynamic symbol, but addr2line can tell
+         * the line from the offset within the binary
+         */
+        const char *base = strrchr(info.dli_fname, '/');
+        snprintf(name, sizeof(name), "%s+%#lx",
+                 base ? base + 1 : info.dli_fname,
+                 (unsigned long) ((char *) site->caller -
+                                  (char *) info.dli_fbase));
+    }
+
+    char hist[MAX_CHAR];
+    size_t len = 0;
+    hist[0] = '\0';
+    for (int b = 0; b < PROFILE_BUCKETS && len < sizeof(hist); b++) {
+        if (!site->histogram[b])
+            continue;
+        len += snprintf(hist + len, sizeof(hist) - len,
+                        b < PROFILE_BUCKETS - 1 ? " <=%lu:%lu" : " >%lu:%lu",
+                        1UL << (b < PROFILE_BUCKETS - 1 ? b : b - 1),
+                        (unsigned long) site->histogram[b]);
+    }
+    report(1, "%-28s %10lu %12lu %s", name, (unsigned long) site->blocks,
+           (unsigned long) site->bytes, hist);
+}
+
+void alloc_profile_report()
+{
+    long bytes = allocation_bytes();
+    pthread_mutex_lock(&profile.lock);
+    size_t blocks = 0, total = 0;
+    for (int i = 0; i < PROFILE_SITES; i++) {
+        blocks += profile.site[i].blocks;
+        total += profile.site[i].bytes;
+    }
+    blocks += profile.other.blocks;
+    total += profile.other.bytes;
+    report(1, "%lu blocks of %lu bytes allocated, %ld bytes live, %ld at peak",
+           (unsigned long) blocks, (unsigned long) total, bytes,
+           profile.peak_bytes);
+
+    report(1, "%-28s %10s %12s  %s", "Call site", "Blocks", "Bytes",
+           "Sizes (bytes:blocks)");
+    for (int i = 0; i < PROFILE_SITES; i++) {
+        if (profile.site[i].caller)
+            profile_report_site(&profile.site[i]);
+    }
+    if (profile.other.blocks)
+        profile_report_site(&profile.other);
+
+    /* The ring tells how fast the latest allocations came */
+    size_t n = profile.recorded < PROFILE_RING_SIZE ? profile.recorded
+                                                     : PROFILE_RING_SIZE;
+    if (n > 1) {
+        const struct timespec *first =
+            &profile.ring[(profile.recorded - n) % PROFILE_RING_SIZE].time;
+        const struct timespec *last =
+            &profile.ring[(profile.recorded - 1) % PROFILE_RING_SIZE].time;
+        double span = (last->tv_sec - first->tv_sec) +
+                      (last->tv_nsec - first->tv_nsec) * 1e-9;
+        report(1, "Latest %lu allocations took %.6f seconds", (unsigned long) n,
+               span);
+    }
+    report(1, "Name a call site BINARY+OFFSET with 'addr2line -f -e BINARY "
+              "OFFSET'");
+    pthread_mutex_unlock(&profile.lock);
+}
+
+/* Size of block b, header and footer included */
+static size_t block_size(const block_element_t *b)
+{
+    return b->payload_size + sizeof(block_element_t) + sizeof(size_t);
+}
+
+/* With quarantine_size set, freed blocks are not reused right away but go
+ * through a quarantine of that many blocks per thread. They are poisoned in
+ * batches of QUARANTINE_BATCH rather than one by one as they are freed, and
+ * when they leave, their payload is checked to still hold nothing but
+ * poison, which catches writes through dangling pointers.
+ */
+#define QUARANTINE_BATCH 32
+
+/* i-th oldest block in the quarantine of cache */
+static block_element_t **quarantine_at(block_cache_t *cache, size_t i)
+{
+    return &cache->quarantine[(cache->quarantine_first + i) %
+                              cache->quarantine_cap];
+}
+
+/* Poison the blocks of cache that went into quarantine since the last batch */
+static void quarantine_poison(block_cache_t *cache)
+{
+    for (size_t i = cache->quarantine_len - cache->quarantine_fresh;
+         i < cache->quarantine_len; i++) {
+        block_element_t *b = *quarantine_at(cache, i);
+        memset(b->payload, FILLCHAR, b->payload_size);
+    }
+    cache->quarantine_fresh = 0;
+}
+
+/* Release the oldest block in the quarantine of cache */
+static void quarantine_evict(block_cache_t *cache)
+{
+    if (cache->quarantine_fresh == cache->quarantine_len)
+        quarantine_poison(cache);
+    block_element_t *b = *quarantine_at(cache, 0);
+    cache->quarantine_first =
+        (cache->quarantine_first + 1) % cache->quarantine_cap;
+    cache->quarantine_len--;
+
+    /* memcmp is the vectorized way to see that every byte is poison */
+    for (size_t i = 0; i < b->payload_size; i += sizeof(poison)) {
+        size_t n = b->payload_size - i;
+        if (memcmp(b->payload + i, poison,
+                   n < sizeof(poison) ? n : sizeof(poison))) {
+            report_event(MSG_ERROR,
+                         "Block with address %p was written to after it "
+                         "was freed",
+                         (void *) b->payload);
+            __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    slab_free(cache, b, block_size(b));
+}
+
+/* Release every block in the quarantine of cache */
+static void quarantine_flush(block_cache_t *cache)
+{
+    while (cache->quarantine_len)
+        quarantine_evict(cache);
+}
+
+/* Put freed block b in the quarantine of cache.
+ * Return false if there is no quarantine to put it in
+ */
+static bool quarantine_add(block_cache_t *cache, block_element_t *b)
+{
+    size_t size = quarantine_size > 0 ? quarantine_size : 0;
+    if (cache->quarantine_cap != size) {
+        quarantine_flush(cache);
+        free(cache->quarantine);
+        cache->quarantine =
+            size ? malloc(size * sizeof(block_element_t *)) : NULL;
+        cache->quarantine_cap = cache->quarantine ? size : 0;
+        cache->quarantine_first = 0;
+    }
+    if (!cache->quarantine_cap)
+        return false;
+
+    if (cache->quarantine_len == cache->quarantine_cap)
+        quarantine_evict(cache);
+    *quarantine_at(cache, cache->quarantine_len++) = b;
+    if (++cache->quarantine_fresh == QUARANTINE_BATCH)
+        quarantine_poison(cache);
+    return true;
+}
+
+bool quarantine_scribble()
+{
+    block_cache_t *cache = thread_cache();
+    if (!cache || !cache->quarantine_len)
+        return false;
+    block_element_t *b = *quarantine_at(cache, cache->quarantine_len - 1);
+    if (!b->payload_size)
+        return false;
+    /* A write before the batch is poisoned would be painted over */
+    quarantine_poison(cache);
+    b->payload[0] = ~FILLCHAR;
+    return true;
+}
+
+/* Find header of block, given its payload, and take it out of the registry.
+ * Signal error and return NULL if doesn't seem like legitimate block
  */
 static block_element_t *find_header(void *p)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
     }
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
+    /* Unregistering the block also claims it against a concurrent free */
+    if (!registry_remove(b) && cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
+        return NULL;
     }
 
     if (b->magic_header != MAGICHEADER) {
@@ -107,7 +689,8 @@ static block_element_t *find_header(void *p)
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
             p);
-        error_occurred = true;
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
+        return NULL;
     }
 
     return b;
@@ -122,7 +705,7 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type, size_t size, void *caller)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -142,11 +725,14 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
+    block_cache_t *cache = thread_cache();
     block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
+        cache ? slab_alloc(cache, size + sizeof(block_element_t) +
+                                      sizeof(size_t))
+              : NULL;
+    if (!new_block || !registry_add(new_block)) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
@@ -157,14 +743,9 @@ static void *alloc(alloc_t alloc_type, size_t size)
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    cache_account(cache, 1, size);
+    if (alloc_profile)
+        profile_record(caller, size);
 
     return p;
 }
@@ -173,7 +754,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, __builtin_return_address(0));
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,7 +765,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
 }
 
 void test_free(void *p)
@@ -197,38 +778,42 @@ void test_free(void *p)
     if (!p)
         return;
 
+    block_cache_t *cache = thread_cache();
+    if (!cache) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Putting a block that is not ours on a free list would hand it out
+     * again, so leave it alone once the error is reported
+     */
     block_element_t *b = find_header(p);
+    if (!b)
+        return;
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
                      p);
-        error_occurred = true;
+        __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    cache_account(cache, -1, -(long) b->payload_size);
 
-    free(b);
-    allocated_count--;
+    if (!quarantine_add(cache, b)) {
+        memset(p, FILLCHAR, b->payload_size);
+        slab_free(cache, b, block_size(b));
+    }
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -237,7 +822,17 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    long count = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (block_cache_t *c = caches; c; c = c->next) {
+        /* Freed blocks are all checked for writes by now */
+        quarantine_flush(c);
+        count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+    }
+    if (!count)
+        slab_release();
+    pthread_mutex_unlock(&cache_lock);
+    return count;
 }
 
 /* Implementation of functions for testing */
@@ -261,9 +856,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return __atomic_exchange_n(&error_occurred, false, __ATOMIC_RELAXED);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -309,7 +902,7 @@ void exception_cancel()
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
-    error_occurred = true;
+    __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
     error_message = msg;
     if (jmp_ready)
         siglongjmp(env, 1);
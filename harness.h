@@ -18,12 +18,42 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, summed over every thread.
+ * Must not run while other threads allocate or free blocks.
+ */
 size_t allocation_check();
 
+/* Report the payload bytes of the allocated blocks, summed over every thread */
+long allocation_bytes();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seconds an operation may take before exception_setup() stops it */
+extern int time_limit;
+
+/* Number of freed blocks each thread keeps in quarantine before reusing
+ * them, checking that they were not written to meanwhile. 0 turns it off.
+ */
+extern int quarantine_size;
+
+/* Poison the newest block in the quarantine of this thread and write to it,
+ * as a use after free would, for the next allocation_check() to report.
+ * Return false if there is no such block
+ */
+bool quarantine_scribble();
+
+/* Record every allocation for alloc_profile_report() while set */
+extern int alloc_profile;
+
+/* Forget the allocations recorded so far */
+void alloc_profile_reset();
+
+/* Report the recorded allocations per call site, with a histogram of their
+ * sizes, and the most payload bytes that were live at once
+ */
+void alloc_profile_report();
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
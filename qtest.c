@@ -53,7 +53,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,6 +74,12 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Remove through q_remove_{head,tail}_view() and check the borrowed string */
+static int remove_view = 0;
+
+/* Insert repeated strings through q_insert_{head,tail}_bulk() */
+static int bulk_insert = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -101,9 +106,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +118,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -125,7 +126,7 @@ static bool do_free(int argc, char *argv[])
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
 
     size_t bcnt = allocation_check();
     if (!chain.size && bcnt > 0) {
@@ -158,7 +159,7 @@ static bool do_new(int argc, char *argv[])
         current = qctx;
     }
     exception_cancel();
-    q_show(3);
+    ok = q_show(3) && ok;
 
     return ok && !error_check();
 }
@@ -180,6 +181,79 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Insert @reps copies of @inserts, or @reps random strings when @need_rand is
+ * set, through a single bulk call
+ */
+static bool queue_insert_bulk(position_t pos,
+                              char *inserts,
+                              bool need_rand,
+                              int reps)
+{
+    char **strs = malloc(reps * sizeof(char *));
+    char *rand_bufs =
+        need_rand ? malloc((size_t) reps * MAX_RANDSTR_LEN) : NULL;
+    if (!strs || (need_rand && !rand_bufs)) {
+        free(strs);
+        free(rand_bufs);
+        report(1, "INTERNAL ERROR.  Could not allocate space for insertion");
+        return false;
+    }
+    for (int r = 0; r < reps; r++) {
+        strs[r] = inserts;
+        if (need_rand) {
+            strs[r] = rand_bufs + (size_t) r * MAX_RANDSTR_LEN;
+            fill_rand_string(strs[r], MAX_RANDSTR_LEN);
+        }
+    }
+
+    bool ok = true;
+    bool rval = pos == POS_TAIL ? q_insert_tail_bulk(current->q, strs, reps)
+                                : q_insert_head_bulk(current->q, strs, reps);
+    if (rval) {
+        current->size += reps;
+        /* The last two elements inserted sit at the end of the queue */
+        struct list_head *last =
+            pos == POS_TAIL ? current->q->prev : current->q->next;
+        struct list_head *prev = pos == POS_TAIL ? last->prev : last->next;
+        char *cur_inserts = list_entry(last, element_t, list)->value;
+        char *lasts = list_entry(prev, element_t, list)->value;
+        if (!cur_inserts || !lasts) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            ok = false;
+        } else if (cur_inserts == strs[reps - 1] || lasts == strs[reps - 2]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new "
+                   "queue element");
+            ok = false;
+        } else if (!q_head(current->q)->intern && lasts == cur_inserts) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each "
+                   "queue element");
+            ok = false;
+        } else if (q_head(current->q)->intern &&
+                   (lasts == cur_inserts) != !strcmp(lasts, cur_inserts)) {
+            report(1,
+                   "ERROR: Equal strings need to share one interned copy, "
+                   "distinct ones need their own");
+            ok = false;
+        }
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %d strings failed", reps);
+        else {
+            report(1,
+                   "ERROR: Insertion of %d strings failed (%d failures total)",
+                   reps, fail_count);
+            ok = false;
+        }
+    }
+
+    free(strs);
+    free(rand_bufs);
+    return ok && !error_check();
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -226,7 +300,11 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
-    if (current && exception_setup(true)) {
+    /* Injected malloc failures are only graded through the per-call path */
+    if (current && reps > 1 && bulk_insert && !fail_probability) {
+        if (exception_setup(true))
+            ok = queue_insert_bulk(pos, inserts, need_rand, reps);
+    } else if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
@@ -248,12 +326,31 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (r == 1 && !q_head(current->q)->intern &&
+                           lasts == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
                     ok = false;
                     break;
+                } else if (r >= 1 && q_head(current->q)->intern &&
+                           (lasts == cur_inserts) !=
+                               !strcmp(lasts, cur_inserts)) {
+                    report(1,
+                           "ERROR: Equal strings need to share one interned "
+                           "copy, distinct ones need their own");
+                    ok = false;
+                    break;
+                } else if (q_sso && !q_head(current->q)->use_arena &&
+                           !q_head(current->q)->intern &&
+                           (strlen(cur_inserts) < Q_SSO_SIZE) !=
+                               q_element_is_inline(entry)) {
+                    report(1,
+                           "ERROR: Strings shorter than %d bytes must be "
+                           "stored inside the element",
+                           Q_SSO_SIZE);
+                    ok = false;
+                    break;
                 }
                 lasts = cur_inserts;
             } else {
@@ -272,7 +369,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
     exception_cancel();
 
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok;
 }
 
@@ -288,6 +385,64 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Remove @count elements in one call and check each against @expected */
+static bool queue_remove_bulk(position_t pos, char *expected, char *count)
+{
+    int n;
+    if (!get_int(count, &n) || n < 1) {
+        report(1, "Invalid number of removals '%s'", count);
+        return false;
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    LIST_HEAD(out);
+    int removed = 0;
+    if (current && exception_setup(true))
+        removed = pos == POS_TAIL ? q_remove_tail_n(current->q, n, &out)
+                                  : q_remove_head_n(current->q, n, &out);
+    exception_cancel();
+
+    bool ok = true;
+    int cnt = 0;
+    element_t *item, *tmp;
+    list_for_each_entry_safe (item, tmp, &out, list) {
+        if (ok && strcmp(item->value, expected)) {
+            report(1, "ERROR: Removed value %s != expected value %s",
+                   item->value, expected);
+            ok = false;
+        }
+        q_release_element(item);
+        cnt++;
+    }
+
+    int size = current ? current->size : 0;
+    if (cnt != removed) {
+        report(1, "ERROR: Removed %d elements, but %d were handed back",
+               removed, cnt);
+        ok = false;
+    } else if (removed != (n < size ? n : size)) {
+        report(1, "ERROR: Removed %d elements, but expected %d", removed,
+               n < size ? n : size);
+        ok = false;
+    } else if (!removed) {
+        fail_count++;
+        report(1, "ERROR: Removal from queue failed (%d failures total)",
+               fail_count);
+        ok = false;
+    } else {
+        report(2, "Removed %d elements from queue", removed);
+    }
+    if (current)
+        current->size -= cnt;
+
+    ok = q_show(3) && ok;
+    return ok && !error_check();
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -312,10 +467,12 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
+    if (argc == 3)
+        return queue_remove_bulk(pos, argv[1], argv[2]);
 
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
@@ -349,14 +506,38 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+    const char *view = NULL;
+    size_t view_len = 0;
+    if (current && exception_setup(true)) {
+        if (remove_view)
+            re = pos == POS_TAIL
+                     ? q_remove_tail_view(current->q, &view, &view_len)
+                     : q_remove_head_view(current->q, &view, &view_len);
+        else
+            re = pos == POS_TAIL
+                     ? q_remove_tail(current->q, removes, string_length + 1)
+                     : q_remove_head(current->q, removes, string_length + 1);
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
 
+    if (!is_null && remove_view) {
+        /* The view must be the element's own string, which has to outlive
+         * the removal. Copy it out for the checks below before releasing.
+         */
+        if (view != re->value) {
+            report(1, "ERROR: View does not point to the removed string");
+            ok = false;
+        } else if (strlen(view) != view_len) {
+            report(1, "ERROR: View length %zu != string length %zu", view_len,
+                   strlen(view));
+            ok = false;
+        }
+        strncpy(removes, re->value, string_length);
+        removes[string_length] = '\0';
+    }
+
     if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
@@ -400,7 +581,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         ok = false;
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
 
     free(removes);
     free(checks);
@@ -508,7 +689,100 @@ static bool do_dedup(int argc, char *argv[])
         free(item);
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
+    return ok && !error_check();
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static bool do_hdedup(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+
+    /* Keep the strings in queue order, plus a sorted copy of the pointers
+     * to tell which of them occur more than once
+     */
+    size_t n = current->size, i = 0;
+    char **values = malloc((n + 1) * sizeof(char *));
+    char **sorted = malloc((n + 1) * sizeof(char *));
+    if (!values || !sorted) {
+        free(values);
+        free(sorted);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
+    }
+    element_t *item;
+    list_for_each_entry (item, current->q, list) {
+        if (i == n || !(values[i] = strdup(item->value)))
+            break;
+        sorted[i] = values[i];
+        i++;
+    }
+    if (&item->list != current->q) {
+        while (i)
+            free(values[--i]);
+        free(values);
+        free(sorted);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
+    }
+    qsort(sorted, n, sizeof(char *), cmp_str);
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_delete_dup_hash(current->q);
+    exception_cancel();
+
+    if (!ok) {
+        if (n)
+            report(1, "WARNING: Could not allocate the duplicate table");
+        else
+            report(1, "ERROR: Calling hash delete duplicate on null queue");
+    } else {
+        struct list_head *l_tmp = current->q->next;
+        for (i = 0; i < n; i++) {
+            char **found = bsearch(&values[i], sorted, n, sizeof(char *),
+                                   cmp_str);
+            bool is_dup = (found > sorted && !strcmp(found[-1], *found)) ||
+                          (found + 1 < sorted + n && !strcmp(found[1], *found));
+            if (is_dup) {
+                current->size--;
+            } else if (l_tmp != current->q &&
+                       !strcmp(list_entry(l_tmp, element_t, list)->value,
+                               values[i])) {
+                l_tmp = l_tmp->next;
+            } else {
+                ok = false;
+            }
+        }
+        ok = ok && l_tmp == current->q;
+        if (!ok)
+            report(1,
+                   "ERROR: Duplicate strings are in queue or distinct strings "
+                   "are not in queue in original order");
+    }
+
+    for (i = 0; i < n; i++)
+        free(values[i]);
+    free(values);
+    free(sorted);
+
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -529,8 +803,8 @@ static bool do_reverse(int argc, char *argv[])
     exception_cancel();
 
     set_noallocate_mode(false);
-    q_show(3);
-    return !error_check();
+    bool ok = q_show(3);
+    return ok && !error_check();
 }
 
 static bool do_size(int argc, char *argv[])
@@ -571,7 +845,7 @@ static bool do_size(int argc, char *argv[])
         }
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
 
     return ok && !error_check();
 }
@@ -594,7 +868,12 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
+    /* Sorting through prefix keys needs a scratch array, so allow that but
+     * make sure it is freed again
+     */
+    bool scratch = q_keysort_threshold > 0;
+    size_t blocks = allocation_check();
+    set_noallocate_mode(!scratch);
 
 /* If the number of elements is too large, it may take a long time to check the
  * stability of the sort. So, MAX_NODES is used to limit the number of elements
@@ -618,6 +897,11 @@ bool do_sort(int argc, char *argv[])
     set_noallocate_mode(false);
 
     bool ok = true;
+    if (scratch && allocation_check() != blocks) {
+        report(1, "ERROR: Sort left %ld blocks allocated",
+               (long) (allocation_check() - blocks));
+        ok = false;
+    }
     if (current && current->size) {
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
@@ -663,7 +947,7 @@ bool do_sort(int argc, char *argv[])
     }
 #undef MAX_NODES
 
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -689,7 +973,7 @@ static bool do_dm(int argc, char *argv[])
         report(3, "Warning: Try to delete middle node to empty queue");
     else
         --current->size;
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -713,8 +997,8 @@ static bool do_swap(int argc, char *argv[])
 
     set_noallocate_mode(false);
 
-    q_show(3);
-    return !error_check();
+    bool ok = q_show(3);
+    return ok && !error_check();
 }
 
 
@@ -761,7 +1045,7 @@ static bool do_ascend(int argc, char *argv[])
         }
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -808,7 +1092,7 @@ static bool do_descend(int argc, char *argv[])
         }
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -838,8 +1122,8 @@ static bool do_reverseK(int argc, char *argv[])
     exception_cancel();
 
     set_noallocate_mode(false);
-    q_show(3);
-    return !error_check();
+    bool ok = q_show(3);
+    return ok && !error_check();
 }
 
 static bool do_merge(int argc, char *argv[])
@@ -862,7 +1146,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -909,7 +1193,7 @@ static bool do_merge(int argc, char *argv[])
         }
     }
 
-    q_show(3);
+    ok = q_show(3) && ok;
     return ok && !error_check();
 }
 
@@ -937,9 +1221,36 @@ static bool is_circular()
     return true;
 }
 
+/* The chunks of an unrolled queue or the ring of a ring queue, when in step,
+ * list the same elements as its links
+ */
+static bool backend_matches()
+{
+    queue_head_t *qh = q_head(current->q);
+    bool in_step = (qh->unrolled && qh->chunks_valid) ||
+                   (qh->use_ring && qh->ring_valid);
+    if (!in_step)
+        return true;
+
+    q_iter_t it;
+    struct list_head *cur = current->q->next;
+    for (element_t *e = q_iter_first(current->q, &it); e;
+         e = q_iter_next(&it), cur = cur->next) {
+        if (cur == current->q || e != list_entry(cur, element_t, list))
+            return false;
+    }
+    return cur == current->q;
+}
+
 static bool q_show(int vlevel)
 {
     bool ok = true;
+    /* Checked at every verbosity, as a backend bug shows nowhere else */
+    if (current && current->q && !backend_matches()) {
+        report(1, "ERROR:  Queue backend is out of step with its links");
+        return false;
+    }
+
     if (verblevel < vlevel)
         return true;
 
@@ -956,12 +1267,12 @@ static bool q_show(int vlevel)
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    q_iter_t it;
+    element_t *e = NULL;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
+        for (e = q_iter_first(current->q, &it); ok && e && cnt < current->size;
+             e = q_iter_next(&it)) {
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
                 if (show_entropy) {
@@ -971,7 +1282,6 @@ static bool q_show(int vlevel)
                 }
             }
             cnt++;
-            cur = cur->next;
             ok = ok && !error_check();
         }
     }
@@ -982,7 +1292,7 @@ static bool q_show(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (!e) {
         if (cnt <= BIG_LIST_SIZE)
             report(vlevel, "]");
         else
@@ -997,6 +1307,58 @@ static bool q_show(int vlevel)
     return ok;
 }
 
+static bool do_scribble(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    error_check();
+    if (!quarantine_scribble()) {
+        report(1, "ERROR: No freed block in quarantine to write to");
+        return false;
+    }
+
+    /* Every block leaving the quarantine is checked, so empty it */
+    allocation_check();
+    if (!error_check()) {
+        report(1, "ERROR: Write to a block in quarantine went unreported");
+        return false;
+    }
+    report(1, "Write to a block in quarantine was reported");
+    return true;
+}
+
+static bool do_allocprof(int argc, char *argv[])
+{
+    int expected = -1;
+    if (argc > 2 ||
+        (argc == 2 && (!get_int(argv[1], &expected) || expected < 0))) {
+        report(1, "%s takes an optional number of bytes", argv[0]);
+        return false;
+    }
+
+    if (!alloc_profile)
+        report(1,
+               "Warning: Allocations are recorded with 'option allocprof 1'");
+    alloc_profile_report();
+
+    long bytes = allocation_bytes();
+    if (expected >= 0 && bytes != expected) {
+        report(1, "ERROR: %ld bytes live, expected %d", bytes, expected);
+        return false;
+    }
+    return true;
+}
+
+/* Start a fresh profile whenever 'option allocprof' turns it on */
+static void allocprof_set(int oldval)
+{
+    if (!oldval && alloc_profile)
+        alloc_profile_reset();
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1070,20 +1432,24 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
-    ADD_COMMAND(
-        rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
-    ADD_COMMAND(
-        rt,
-        "Remove from tail of queue. Optionally compare to expected value str",
-        "[str]");
+    ADD_COMMAND(rh,
+                "Remove from head of queue. Optionally compare to expected "
+                "value str, or remove n elements at once, each equal to str",
+                "[str [n]]");
+    ADD_COMMAND(rt,
+                "Remove from tail of queue. Optionally compare to expected "
+                "value str, or remove n elements at once, each equal to str",
+                "[str [n]]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
+    ADD_COMMAND(hdedup,
+                "Delete all nodes whose string appears more than once, "
+                "sorted or not",
+                "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
     ADD_COMMAND(ascend,
@@ -1096,14 +1462,62 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(scribble,
+                "Write to a freed block in quarantine, which 'option "
+                "quarantine' must report",
+                "");
+    ADD_COMMAND(allocprof,
+                "Show where the queue code allocated since "
+                "'option allocprof 1', optionally checking the bytes live",
+                "[bytes]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("timelimit", &time_limit,
+              "Seconds before an operation is stopped (0: no limit)", NULL);
+    add_param("quarantine", &quarantine_size,
+              "Number of freed blocks kept from reuse and checked for writes",
+              NULL);
+    add_param("allocprof", &alloc_profile,
+              "Record allocations for the allocprof command", allocprof_set);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("inline", &q_inline_value,
+              "Allocate each element and its string as a single block", NULL);
+    add_param("sso", &q_sso,
+              "Keep strings shorter than 24 bytes inside fixed-size elements",
+              NULL);
+    add_param("keysort", &q_keysort_threshold,
+              "Minimum queue size to sort through prefix keys (0: never)",
+              NULL);
+    add_param("radix", &q_radix_sort,
+              "Sort queue with MSD radix sort instead of merge sort", NULL);
+    add_param("sortthreads", &q_sort_threads,
+              "Number of threads used to sort large queues", NULL);
+    add_param("mergethreads", &q_merge_threads,
+              "Number of threads used to merge queues", NULL);
+    add_param("trackmid", &q_track_mid,
+              "Have new queues track their middle node for 'dm'", NULL);
+    add_param("prefixcmp", &q_prefix_compare,
+              "Compare 8-byte string prefixes first in 'ascend'/'descend'",
+              NULL);
+    add_param("arena", &q_arena,
+              "Carve the elements of new queues out of per-queue chunks", NULL);
+    add_param("intern", &q_intern,
+              "Have new queues share equal strings through a pool", NULL);
+    add_param("unrolled", &q_unrolled,
+              "Have new queues keep their elements in chunks as well", NULL);
+    add_param("ring", &q_ring,
+              "Have new queues keep their elements in a ring buffer as well",
+              NULL);
+    add_param("bulk", &bulk_insert,
+              "Insert repeated strings in one bulk call unless malloc fails",
+              NULL);
+    add_param("view", &remove_view,
+              "Remove without copying and check the borrowed string", NULL);
 }
 
 /* Signal handlers */
@@ -1136,8 +1550,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1151,7 +1563,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1165,11 +1576,13 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f FILE][-v LEVEL][-l LOG\n", cmd);
+    printf("Usage: %s [-h] [-f FILE][-v LEVEL][-l LOG][-b BACKEND]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f FILE   Read commands from FILE\n");
     printf("\t-v LEVEL  Set verbosity level\n");
     printf("\t-l LOG    Echo results to LOG\n");
+    printf("\t-b BACKEND  Queue backend: 'list' (default), 'unrolled' or "
+           "'ring'\n");
     exit(0);
 }
 
@@ -1379,7 +1792,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:b:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1404,6 +1817,16 @@ int main(int argc, char *argv[])
             lbuf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'b':
+            if (!strcmp(optarg, "unrolled"))
+                q_unrolled = 1;
+            else if (!strcmp(optarg, "ring"))
+                q_ring = 1;
+            else if (strcmp(optarg, "list")) {
+                fprintf(stderr, "Unknown queue backend '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1,38 +1,795 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "queue.h"
 
+int q_inline_value = 0;
+int q_sso = 0;
+int q_keysort_threshold = 0;
+int q_radix_sort = 0;
+int q_sort_threads = 1;
+int q_merge_threads = 1;
+int q_track_mid = 0;
+int q_prefix_compare = 0;
+int q_arena = 0;
+int q_intern = 0;
+int q_unrolled = 0;
+int q_ring = 0;
+size_t q_interned = 0;
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (!head) {
+    queue_head_t *qh = malloc(sizeof(queue_head_t));
+    if (!qh) {
         return NULL;
     }
-    INIT_LIST_HEAD(head);
-    return head;
+    INIT_LIST_HEAD(&qh->head);
+    qh->size = 0;
+    qh->track_mid = q_track_mid;
+    qh->mid = NULL;
+    qh->mid_index = 0;
+    qh->use_arena = q_arena;
+    memset(&qh->arena, 0, sizeof(qh->arena));
+    INIT_LIST_HEAD(&qh->arena.chunks);
+    qh->intern = q_intern && !q_arena;
+    qh->unrolled = q_unrolled && !q_ring;
+    qh->chunks_valid = true;
+    INIT_LIST_HEAD(&qh->chunks);
+    qh->use_ring = q_ring;
+    qh->ring_valid = true;
+    qh->ring = NULL;
+    qh->ring_first = qh->ring_len = qh->ring_cap = 0;
+    return &qh->head;
+}
+
+/* The tracked middle node sits at index (size - 1) / 2. Operations at the
+ * ends adjust mid_index for the nodes they add or remove in front of it, then
+ * mid_seek() steps it back into place. A NULL mid on a non-empty queue means
+ * it is unknown.
+ */
+static void mid_seek(queue_head_t *qh)
+{
+    int target = (qh->size - 1) / 2;
+    for (; qh->mid_index < target; qh->mid_index++)
+        qh->mid = qh->mid->next;
+    for (; qh->mid_index > target; qh->mid_index--)
+        qh->mid = qh->mid->prev;
+}
+
+/* Account for n nodes just linked at the head end of queue, or its tail end */
+static void mid_added(queue_head_t *qh, int n, bool at_head)
+{
+    if (!qh->track_mid)
+        return;
+    if (qh->size == n) {
+        qh->mid = qh->head.next;
+        qh->mid_index = 0;
+    } else if (!qh->mid) {
+        return;
+    } else if (at_head) {
+        qh->mid_index += n;
+    }
+    mid_seek(qh);
+}
+
+/* Forget the middle node after an operation too involved to follow */
+static inline void mid_forget(struct list_head *head)
+{
+    q_head(head)->mid = NULL;
+}
+
+/* An unrolled queue also lists its elements in chunks of Q_CHUNK_SLOTS
+ * pointers. Operations at the ends and q_delete_mid() keep the chunks in step
+ * with the list. Others only mark them stale, and chunks_sync() lays them out
+ * again the next time they are needed. Failing to allocate a chunk leaves the
+ * chunks stale instead of failing the operation.
+ */
+static inline q_chunk_t *chunks_first(queue_head_t *qh)
+{
+    return list_entry(qh->chunks.next, q_chunk_t, link);
+}
+
+static inline q_chunk_t *chunks_last(queue_head_t *qh)
+{
+    return list_entry(qh->chunks.prev, q_chunk_t, link);
+}
+
+/* Mark the chunks stale after an operation too involved to follow */
+static inline void chunks_forget(struct list_head *head)
+{
+    q_head(head)->chunks_valid = false;
+}
+
+/* Put e in front of the chunks of qh, or after them */
+static bool chunks_push(queue_head_t *qh, element_t *e, bool at_head)
+{
+    q_chunk_t *c;
+    if (!list_empty(&qh->chunks)) {
+        c = at_head ? chunks_first(qh) : chunks_last(qh);
+        if (at_head ? c->begin > 0 : c->end < Q_CHUNK_SLOTS) {
+            c->slot[at_head ? --c->begin : c->end++] = e;
+            return true;
+        }
+    }
+
+    c = malloc(sizeof(q_chunk_t));
+    if (!c)
+        return false;
+    c->begin = c->end = at_head ? Q_CHUNK_SLOTS : 0;
+    if (at_head)
+        list_add(&c->link, &qh->chunks);
+    else
+        list_add_tail(&c->link, &qh->chunks);
+    c->slot[at_head ? --c->begin : c->end++] = e;
+    return true;
+}
+
+/* Account in the chunks for n nodes just linked at the head end of queue, or
+ * its tail end
+ */
+static void chunks_added(queue_head_t *qh, int n, bool at_head)
+{
+    if (!qh->unrolled || !qh->chunks_valid)
+        return;
+    struct list_head *node = at_head ? qh->head.next : qh->head.prev;
+    for (int i = 1; i < n; i++)
+        node = at_head ? node->next : node->prev;
+    for (; n; n--, node = at_head ? node->prev : node->next) {
+        if (!chunks_push(qh, list_entry(node, element_t, list), at_head)) {
+            qh->chunks_valid = false;
+            return;
+        }
+    }
+}
+
+/* Take n slots off the head end of the chunks, or their tail end */
+static void chunks_drop(queue_head_t *qh, int n, bool at_head)
+{
+    if (!qh->unrolled || !qh->chunks_valid)
+        return;
+    while (n) {
+        q_chunk_t *c = at_head ? chunks_first(qh) : chunks_last(qh);
+        int k = c->end - c->begin < n ? c->end - c->begin : n;
+        if (at_head)
+            c->begin += k;
+        else
+            c->end -= k;
+        n -= k;
+        if (c->begin == c->end) {
+            list_del(&c->link);
+            free(c);
+        }
+    }
+}
+
+/* Find the chunk holding the element at index of the queue, walking from the
+ * nearer end, and turn index into its slot there
+ */
+static q_chunk_t *chunks_find(queue_head_t *qh, int *index)
+{
+    struct list_head *pos;
+    if (*index < qh->size / 2) {
+        for (pos = qh->chunks.next; pos != &qh->chunks; pos = pos->next) {
+            q_chunk_t *c = list_entry(pos, q_chunk_t, link);
+            if (*index < c->end - c->begin) {
+                *index += c->begin;
+                return c;
+            }
+            *index -= c->end - c->begin;
+        }
+    } else {
+        int back = qh->size - 1 - *index;
+        for (pos = qh->chunks.prev; pos != &qh->chunks; pos = pos->prev) {
+            q_chunk_t *c = list_entry(pos, q_chunk_t, link);
+            if (back < c->end - c->begin) {
+                *index = c->end - 1 - back;
+                return c;
+            }
+            back -= c->end - c->begin;
+        }
+    }
+    return NULL;
+}
+
+/* Take the slot of the element at index of the queue out of the chunks */
+static void chunks_remove(queue_head_t *qh, int index)
+{
+    if (!qh->unrolled || !qh->chunks_valid)
+        return;
+    if (index == 0 || index == qh->size - 1) {
+        chunks_drop(qh, 1, index == 0);
+        return;
+    }
+
+    /* Close the gap from the shorter side */
+    q_chunk_t *c = chunks_find(qh, &index);
+    if (index - c->begin < c->end - 1 - index) {
+        memmove(&c->slot[c->begin + 1], &c->slot[c->begin],
+                (index - c->begin) * sizeof(c->slot[0]));
+        c->begin++;
+    } else {
+        memmove(&c->slot[index], &c->slot[index + 1],
+                (c->end - 1 - index) * sizeof(c->slot[0]));
+        c->end--;
+    }
+    if (c->begin == c->end) {
+        list_del(&c->link);
+        free(c);
+    }
+}
+
+/* Lay the chunks of qh out again from the list if they are stale, reusing
+ * the chunks it already has
+ */
+static bool chunks_sync(queue_head_t *qh)
+{
+    if (qh->chunks_valid)
+        return true;
+
+    struct list_head *pos = qh->chunks.next;
+    q_chunk_t *c = NULL;
+    element_t *e;
+    list_for_each_entry (e, &qh->head, list) {
+        if (!c || c->end == Q_CHUNK_SLOTS) {
+            if (pos != &qh->chunks) {
+                c = list_entry(pos, q_chunk_t, link);
+                pos = pos->next;
+            } else {
+                c = malloc(sizeof(q_chunk_t));
+                if (!c)
+                    return false;
+                list_add_tail(&c->link, &qh->chunks);
+            }
+            c->begin = c->end = 0;
+        }
+        c->slot[c->end++] = e;
+    }
+
+    /* Chunks left over from a longer queue */
+    while (pos != &qh->chunks) {
+        c = list_entry(pos, q_chunk_t, link);
+        pos = pos->next;
+        list_del(&c->link);
+        free(c);
+    }
+    qh->chunks_valid = true;
+    return true;
+}
+
+/* Free the chunks of qh */
+static void chunks_release(queue_head_t *qh)
+{
+    q_chunk_t *c, *safe;
+    list_for_each_entry_safe (c, safe, &qh->chunks, link)
+        free(c);
+}
+
+/* A ring queue also keeps its elements in a circular array whose capacity is
+ * a power of two, which makes every position an index computation. It is
+ * kept in step and goes stale the same way as the chunks above. It grows by
+ * doubling and is halved once less than a quarter full, so that a queue
+ * drained by removals gives its array back.
+ */
+#define RING_MIN_CAP 8
+
+static inline element_t **ring_at(const queue_head_t *qh, unsigned i)
+{
+    return &qh->ring[(qh->ring_first + i) & (qh->ring_cap - 1)];
+}
+
+/* Mark the ring stale after an operation too involved to follow */
+static inline void ring_forget(struct list_head *head)
+{
+    q_head(head)->ring_valid = false;
+}
+
+/* Forget the middle node, the chunks and the ring */
+static inline void order_forget(struct list_head *head)
+{
+    mid_forget(head);
+    chunks_forget(head);
+    ring_forget(head);
+}
+
+/* Move the ring of qh to a new array of cap slots, unwrapping it */
+static bool ring_resize(queue_head_t *qh, unsigned cap)
+{
+    element_t **ring = malloc(cap * sizeof(element_t *));
+    if (!ring)
+        return false;
+    for (unsigned i = 0; i < qh->ring_len; i++)
+        ring[i] = *ring_at(qh, i);
+    free(qh->ring);
+    qh->ring = ring;
+    qh->ring_first = 0;
+    qh->ring_cap = cap;
+    return true;
+}
+
+/* Account in the ring for n nodes just linked at the head end of queue, or
+ * its tail end
+ */
+static void ring_added(queue_head_t *qh, int n, bool at_head)
+{
+    if (!qh->use_ring || !qh->ring_valid)
+        return;
+    if (qh->ring_len + n > qh->ring_cap) {
+        unsigned cap = qh->ring_cap ? qh->ring_cap : RING_MIN_CAP;
+        while (cap < qh->ring_len + n)
+            cap *= 2;
+        if (!ring_resize(qh, cap)) {
+            qh->ring_valid = false;
+            return;
+        }
+    }
+
+    struct list_head *node = at_head ? qh->head.next : qh->head.prev;
+    if (at_head)
+        qh->ring_first = (qh->ring_first - n) & (qh->ring_cap - 1);
+    qh->ring_len += n;
+    for (int i = 0; i < n; i++) {
+        *ring_at(qh, at_head ? i : qh->ring_len - 1 - i) =
+            list_entry(node, element_t, list);
+        node = at_head ? node->next : node->prev;
+    }
+}
+
+/* Halve the ring of qh until it is at least a quarter full, keeping the old
+ * array if a smaller one cannot be had
+ */
+static void ring_shrink(queue_head_t *qh)
+{
+    unsigned cap = qh->ring_cap;
+    while (cap > RING_MIN_CAP && qh->ring_len < cap / 4)
+        cap /= 2;
+    if (cap != qh->ring_cap)
+        ring_resize(qh, cap);
+}
+
+/* Take n slots off the head end of the ring, or its tail end */
+static void ring_drop(queue_head_t *qh, int n, bool at_head)
+{
+    if (!qh->use_ring || !qh->ring_valid)
+        return;
+    if (at_head)
+        qh->ring_first = (qh->ring_first + n) & (qh->ring_cap - 1);
+    qh->ring_len -= n;
+    ring_shrink(qh);
+}
+
+/* Take the slot at index out of the ring, closing the gap from the shorter
+ * side
+ */
+static void ring_remove(queue_head_t *qh, int index)
+{
+    if (!qh->use_ring || !qh->ring_valid)
+        return;
+    unsigned i = index;
+    if (i < qh->ring_len / 2) {
+        for (; i > 0; i--)
+            *ring_at(qh, i) = *ring_at(qh, i - 1);
+        qh->ring_first = (qh->ring_first + 1) & (qh->ring_cap - 1);
+    } else {
+        for (; i < qh->ring_len - 1; i++)
+            *ring_at(qh, i) = *ring_at(qh, i + 1);
+    }
+    qh->ring_len--;
+    ring_shrink(qh);
+}
+
+/* Reverse the slots from index lo to index hi of the ring */
+static void ring_reverse(queue_head_t *qh, unsigned lo, unsigned hi)
+{
+    for (; lo < hi; lo++, hi--) {
+        element_t *tmp = *ring_at(qh, lo);
+        *ring_at(qh, lo) = *ring_at(qh, hi);
+        *ring_at(qh, hi) = tmp;
+    }
+}
+
+/* Link the nodes of queue in the order of its ring */
+static void ring_relink(queue_head_t *qh)
+{
+    struct list_head *prev = &qh->head;
+    for (unsigned i = 0; i < qh->ring_len; i++) {
+        struct list_head *node = &(*ring_at(qh, i))->list;
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
+    }
+    prev->next = &qh->head;
+    qh->head.prev = prev;
+}
+
+/* Write the nodes of queue into the ring in list order, after they were
+ * reordered without changing their number
+ */
+static void ring_refill(queue_head_t *qh)
+{
+    element_t *e;
+    unsigned i = 0;
+    list_for_each_entry (e, &qh->head, list)
+        *ring_at(qh, i++) = e;
+}
+
+/* Lay the ring of qh out again from the list if it is stale, in an array
+ * that fits if the old one is too small or less than a quarter full
+ */
+static bool ring_sync(queue_head_t *qh)
+{
+    if (qh->ring_valid)
+        return true;
+
+    unsigned size = qh->size, cap = RING_MIN_CAP;
+    while (cap < size)
+        cap *= 2;
+    if (qh->ring_cap < size || qh->ring_cap > 2 * cap) {
+        element_t **ring = malloc(cap * sizeof(element_t *));
+        if (ring) {
+            free(qh->ring);
+            qh->ring = ring;
+            qh->ring_cap = cap;
+        } else if (qh->ring_cap < size) {
+            return false;
+        }
+    }
+
+    element_t *e;
+    qh->ring_first = qh->ring_len = 0;
+    list_for_each_entry (e, &qh->head, list)
+        qh->ring[qh->ring_len++] = e;
+    qh->ring_valid = true;
+    return true;
+}
+
+/* Unlink node at index of queue, which is its head end, its tail end or its
+ * tracked middle, keeping the size, the middle node, the chunks and the ring
+ * up to date
+ */
+static void q_unlink(struct list_head *head,
+                     struct list_head *node,
+                     int index)
+{
+    queue_head_t *qh = q_head(head);
+    if (qh->mid && node != qh->mid) {
+        if (index < qh->mid_index)
+            qh->mid_index--;
+
+    } else if (qh->mid && node->next != head) {
+        /* Its successor moves into its index */
+        qh->mid = node->next;
+    } else if (qh->mid) {
+        qh->mid = node->prev;
+        qh->mid_index--;
+    }
+
+    chunks_remove(qh, index);
+    ring_remove(qh, index);
+    list_del_init(node);
+    if (!--qh->size)
+        qh->mid = NULL;
+    else if (qh->mid)
+        mid_seek(qh);
+}
+
+/* Does the arena of qh hold nothing but the elements linked in the queue? */
+static bool arena_owns_all(const queue_head_t *qh)
+{
+    if (qh->arena.mixed)
+        return false;
+    if (list_empty(&qh->arena.chunks))
+        return !qh->size;
+
+    /* Leave out the hold on the newest chunk */
+    size_t live = 0;
+    const q_slab_t *chunk;
+    list_for_each_entry (chunk, &qh->arena.chunks, link)
+        live += chunk->refs;
+    return live - 1 == (size_t) qh->size;
+}
+
+/* Drop the hold the arena of qh has on its newest chunk, and leave the other
+ * chunks to the elements still in them, which may have moved to other queues
+ */
+static void arena_release(queue_head_t *qh)
+{
+    if (list_empty(&qh->arena.chunks))
+        return;
+    q_slab_t *newest = list_first_entry(&qh->arena.chunks, q_slab_t, link);
+    q_slab_t *chunk, *safe;
+    list_for_each_entry_safe (chunk, safe, &qh->arena.chunks, link)
+        list_del_init(&chunk->link);
+    if (!--newest->refs)
+        free(newest);
 }
 
 /* Free all storage used by queue */
 void q_free(struct list_head *head)
 {
     /* if head is NULL, do nothing */
-    if (!head || list_empty(head)) {
-        free(head);
+    if (!head)
+        return;
+
+    queue_head_t *qh = q_head(head);
+    if (qh->use_arena && arena_owns_all(qh)) {
+        /* No element outlives its chunk, so the chunks go as a whole */
+        q_slab_t *chunk, *safe;
+        list_for_each_entry_safe (chunk, safe, &qh->arena.chunks, link)
+            free(chunk);
+        chunks_release(qh);
+        free(qh->ring);
+        free(qh);
         return;
     }
 
     /* free element_t nodes and string inside iteratively */
     element_t *entry = NULL, *safe = NULL;
-    list_for_each_entry_safe (entry, safe, head, list) {
-        free(entry->value);
-        free(entry);
+    list_for_each_entry_safe (entry, safe, head, list)
+        q_release_element(entry);
+
+    if (qh->use_arena)
+        arena_release(qh);
+    chunks_release(qh);
+    free(qh->ring);
+    free(qh);
+}
+
+/* Bytes taken by a slab element holding a string of @len bytes, rounded up
+ * so that the next element stays aligned
+ */
+static size_t slab_element_size(size_t len)
+{
+    size_t size = sizeof(element_t) + sizeof(q_slab_t *) + len;
+    return (size + _Alignof(element_t) - 1) & ~(_Alignof(element_t) - 1);
+}
+
+/* Lay out an element of slab at p holding a copy of the len bytes of s */
+static element_t *slab_element_init(char *p,
+                                    q_slab_t *slab,
+                                    const char *s,
+                                    size_t len)
+{
+    element_t *element = (element_t *) p;
+    element->layout = Q_ELEMENT_SLAB;
+    memcpy(element->inline_value, &slab, sizeof(slab));
+    element->value = element->inline_value + sizeof(slab);
+    memcpy(element->value, s, len);
+    return element;
+}
+
+/* Arena chunks start this small and double up to the maximum */
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (4 << 20)
+
+/* Carve an element holding a copy of the len bytes of s out of an arena */
+static element_t *arena_element_new(q_arena_t *arena,
+                                    const char *s,
+                                    size_t len)
+{
+    size_t size = slab_element_size(len);
+    if (size > arena->left) {
+        size_t chunk_size =
+            arena->chunk_size ? 2 * arena->chunk_size : ARENA_MIN_CHUNK;
+        if (chunk_size > ARENA_MAX_CHUNK)
+            chunk_size = ARENA_MAX_CHUNK;
+        while (chunk_size < sizeof(q_slab_t) + size)
+            chunk_size *= 2;
+        q_slab_t *chunk = malloc(chunk_size);
+        if (!chunk)
+            return NULL;
+        /* The arena only holds its newest chunk, an older one goes as soon
+         * as its last element is released
+         */
+        chunk->refs = 1;
+        if (!list_empty(&arena->chunks)) {
+            q_slab_t *prev = list_first_entry(&arena->chunks, q_slab_t, link);
+            if (!--prev->refs) {
+                list_del(&prev->link);
+                free(prev);
+            }
+        }
+        list_add(&chunk->link, &arena->chunks);
+        arena->chunk_size = chunk_size;
+        arena->next = (char *) (chunk + 1);
+        arena->left = chunk_size - sizeof(q_slab_t);
     }
 
-    /* connect head->prev and head->next then free head */
-    free(head);
+    q_slab_t *chunk = list_first_entry(&arena->chunks, q_slab_t, link);
+    element_t *element = slab_element_init(arena->next, chunk, s, len);
+    chunk->refs++;
+    arena->next += size;
+    arena->left -= size;
+    return element;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t str_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Interned strings are shared by all queues, since elements move between
+ * them. Each one is counted once per element pointing at it, and the pool
+ * itself goes away together with its last string.
+ */
+typedef struct q_intern_entry {
+    size_t refs;
+    uint64_t hash;
+    struct q_intern_entry *next;
+    char str[];
+} q_intern_entry_t;
+
+static struct {
+    q_intern_entry_t **buckets;
+    size_t mask;
+} pool;
+
+/* Double the buckets of the pool, keeping the old ones if that fails */
+static void intern_grow(void)
+{
+    size_t size = pool.buckets ? 2 * (pool.mask + 1) : 64;
+    q_intern_entry_t **buckets = calloc(size, sizeof(*buckets));
+    if (!buckets)
+        return;
+    for (size_t i = 0; pool.buckets && i <= pool.mask; i++) {
+        q_intern_entry_t *e, *next;
+        for (e = pool.buckets[i]; e; e = next) {
+            next = e->next;
+            e->next = buckets[e->hash & (size - 1)];
+            buckets[e->hash & (size - 1)] = e;
+        }
+    }
+    free(pool.buckets);
+    pool.buckets = buckets;
+    pool.mask = size - 1;
+}
+
+/* Take a reference to the pooled copy of the len bytes of s */
+static char *intern_get(const char *s, size_t len)
+{
+    uint64_t hash = str_hash(s);
+    if (pool.buckets) {
+        q_intern_entry_t *e = pool.buckets[hash & pool.mask];
+        for (; e; e = e->next) {
+            if (e->hash == hash && !strcmp(e->str, s)) {
+                e->refs++;
+                return e->str;
+            }
+        }
+    }
+
+    if (!pool.buckets || q_interned > pool.mask)
+        intern_grow();
+    if (!pool.buckets)
+        return NULL;
+    q_intern_entry_t *e = malloc(sizeof(q_intern_entry_t) + len);
+    if (!e) {
+        if (!q_interned) {
+            free(pool.buckets);
+            memset(&pool, 0, sizeof(pool));
+        }
+        return NULL;
+    }
+    e->refs = 1;
+    e->hash = hash;
+    memcpy(e->str, s, len);
+    e->next = pool.buckets[hash & pool.mask];
+    pool.buckets[hash & pool.mask] = e;
+    q_interned++;
+    return e->str;
+}
+
+/* Drop a reference to s if it is a pooled string */
+bool q_intern_put(const char *s)
+{
+    if (!q_interned)
+        return false;
+    q_intern_entry_t **link = &pool.buckets[str_hash(s) & pool.mask];
+    for (; *link; link = &(*link)->next) {
+        q_intern_entry_t *e = *link;
+        if (e->str != s)
+            continue;
+        if (!--e->refs) {
+            *link = e->next;
+            free(e);
+            if (!--q_interned) {
+                free(pool.buckets);
+                memset(&pool, 0, sizeof(pool));
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Take one more reference to a pooled string */
+static char *intern_dup(char *str)
+{
+    ((q_intern_entry_t *) (str - offsetof(q_intern_entry_t, str)))->refs++;
+    return str;
+}
+
+/* Elements pointing into the pool keep room for the slab they come from */
+#define INTERN_ELEMENT_SIZE (sizeof(element_t) + sizeof(q_slab_t *))
+
+/* Lay out an element at p pointing to the pooled string str, with slab NULL
+ * if the element is allocated on its own
+ */
+static element_t *intern_element_init(char *p, q_slab_t *slab, char *str)
+{
+    element_t *element = (element_t *) p;
+    element->layout = Q_ELEMENT_INTERN;
+    memcpy(element->inline_value, &slab, sizeof(slab));
+    element->value = str;
+    return element;
+}
+
+/* Allocate an element holding a copy of s for the queue qh, from its arena
+ * its string pool, or laid out per q_sso and q_inline_value
+ */
+static element_t *element_new(queue_head_t *qh, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    element_t *element;
+
+    if (qh->use_arena)
+        return arena_element_new(&qh->arena, s, len);
+
+    if (qh->intern) {
+        char *str = intern_get(s, len);
+        if (!str)
+            return NULL;
+        element = malloc(INTERN_ELEMENT_SIZE);
+        if (!element) {
+            q_intern_put(str);
+            return NULL;
+        }
+        return intern_element_init((char *) element, NULL, str);
+    }
+
+    if (q_sso) {
+        /* Fixed-size element, the string stays inline if it fits */
+        element = malloc(sizeof(element_t) + Q_SSO_SIZE);
+        if (!element)
+            return NULL;
+        element->layout = Q_ELEMENT_INLINE;
+        element->value = element->inline_value;
+        if (len > Q_SSO_SIZE) {
+            element->layout = Q_ELEMENT_SEPARATE;
+            element->value = malloc(len);
+            if (!element->value) {
+                free(element);
+                return NULL;
+            }
+        }
+    } else if (q_inline_value) {
+        element = malloc(sizeof(element_t) + len);
+        if (!element)
+            return NULL;
+        element->layout = Q_ELEMENT_INLINE;
+        element->value = element->inline_value;
+    } else {
+        element = malloc(sizeof(element_t));
+        if (!element)
+            return NULL;
+        element->layout = Q_ELEMENT_SEPARATE;
+        element->value = malloc(len);
+        if (!element->value) {
+            free(element);
+            return NULL;
+        }
+    }
+    memcpy(element->value, s, len);
+
+    return element;
 }
 
 /* Insert an element at head of queue */
@@ -41,296 +798,1109 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *element = malloc(sizeof(element_t));
+    element_t *element = element_new(q_head(head), s);
     if (!element)
         return false;
-    element->value = malloc(strlen(s) + 1);
-    if (!element->value) {
-        free(element);
+    list_add(&element->list, head);
+    q_head(head)->size++;
+    mid_added(q_head(head), 1, true);
+    chunks_added(q_head(head), 1, true);
+    ring_added(q_head(head), 1, true);
+
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    element_t *element = element_new(q_head(head), s);
+    if (!element)
+        return false;
+    list_add_tail(&element->list, head);
+    q_head(head)->size++;
+    mid_added(q_head(head), 1, false);
+    chunks_added(q_head(head), 1, false);
+    ring_added(q_head(head), 1, false);
+
+    return true;
+}
+
+/* Carve elements for the n strings of s out of one slab and splice them in,
+ * each new element ahead of the previous one when at_head is set
+ */
+static bool insert_bulk(struct list_head *head,
+                        char *const s[],
+                        int n,
+                        bool at_head)
+{
+    if (!head)
         return false;
+    if (n <= 0)
+        return true;
+
+    LIST_HEAD(chain);
+    queue_head_t *qh = q_head(head);
+    if (qh->use_arena) {
+        /* The queue's arena already amortizes the allocations */
+        for (int i = 0; i < n; i++) {
+            element_t *element = element_new(qh, s[i]);
+            if (!element) {
+                element_t *safe;
+                list_for_each_entry_safe (element, safe, &chain, list)
+                    q_release_element(element);
+                return false;
+            }
+            if (at_head)
+                list_add(&element->list, &chain);
+            else
+                list_add_tail(&element->list, &chain);
+        }
+    } else if (qh->intern) {
+        /* Only the elements share the slab, strings come from the pool */
+        q_slab_t *slab = malloc(sizeof(q_slab_t) + n * INTERN_ELEMENT_SIZE);
+        if (!slab)
+            return false;
+        slab->refs = n;
+        INIT_LIST_HEAD(&slab->link);
+
+        char *p = (char *) (slab + 1), *str = NULL;
+        for (int i = 0; i < n; i++, p += INTERN_ELEMENT_SIZE) {
+            /* Repeated strings are usually passed as the same pointer */
+            str = i && s[i] == s[i - 1] ? intern_dup(str)
+                                        : intern_get(s[i], strlen(s[i]) + 1);
+            if (!str) {
+                while (i--) {
+                    p -= INTERN_ELEMENT_SIZE;
+                    q_intern_put(((element_t *) p)->value);
+                }
+                free(slab);
+                return false;
+            }
+            element_t *element = intern_element_init(p, slab, str);
+            if (at_head)
+                list_add(&element->list, &chain);
+            else
+                list_add_tail(&element->list, &chain);
+        }
+    } else {
+        size_t total = sizeof(q_slab_t);
+        for (int i = 0; i < n; i++)
+            total += slab_element_size(strlen(s[i]) + 1);
+        q_slab_t *slab = malloc(total);
+        if (!slab)
+            return false;
+        slab->refs = n;
+        INIT_LIST_HEAD(&slab->link);
+
+        char *p = (char *) (slab + 1);
+        for (int i = 0; i < n; i++) {
+            size_t len = strlen(s[i]) + 1;
+            element_t *element = slab_element_init(p, slab, s[i], len);
+            if (at_head)
+                list_add(&element->list, &chain);
+            else
+                list_add_tail(&element->list, &chain);
+            p += slab_element_size(len);
+        }
+    }
+    if (at_head)
+        list_splice(&chain, head);
+    else
+        list_splice_tail(&chain, head);
+    q_head(head)->size += n;
+    mid_added(q_head(head), n, at_head);
+    chunks_added(q_head(head), n, at_head);
+    ring_added(q_head(head), n, at_head);
+
+    return true;
+}
+
+/* Insert the strings of s at head of queue, from one allocation */
+bool q_insert_head_bulk(struct list_head *head, char *const s[], int n)
+{
+    return insert_bulk(head, s, n, true);
+}
+
+/* Insert the strings of s at tail of queue, from one allocation */
+bool q_insert_tail_bulk(struct list_head *head, char *const s[], int n)
+{
+    return insert_bulk(head, s, n, false);
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head)) {
+        return NULL;
+    }
+
+    element_t *element = list_first_entry(head, element_t, list);
+    if (sp) {
+        strncpy(sp, element->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+
+    q_unlink(head, &element->list, 0);
+
+    return element;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head)) {
+        return NULL;
+    }
+
+    element_t *element = list_last_entry(head, element_t, list);
+    if (sp) {
+        strncpy(sp, element->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+
+    q_unlink(head, &element->list, q_size(head) - 1);
+
+    return element;
+}
+
+/* Unlink node from queue and lend out its string */
+static element_t *remove_view(struct list_head *head,
+                              struct list_head *node,
+                              const char **view,
+                              size_t *len,
+                              bool at_head)
+{
+    element_t *element = list_entry(node, element_t, list);
+    *view = element->value;
+    if (len)
+        *len = strlen(element->value);
+
+    q_unlink(head, node, at_head ? 0 : q_size(head) - 1);
+
+    return element;
+}
+
+/* Remove an element from head of queue, borrowing its string */
+element_t *q_remove_head_view(struct list_head *head,
+                              const char **view,
+                              size_t *len)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    return remove_view(head, head->next, view, len, true);
+}
+
+/* Remove an element from tail of queue, borrowing its string */
+element_t *q_remove_tail_view(struct list_head *head,
+                              const char **view,
+                              size_t *len)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    return remove_view(head, head->prev, view, len, false);
+}
+
+/* Start walking queue, through its ring or chunks when it has them */
+element_t *q_iter_first(struct list_head *head, q_iter_t *it)
+{
+    queue_head_t *qh = q_head(head);
+    it->head = it->node = head;
+    it->chunk = NULL;
+    it->ring = NULL;
+    if (qh->use_ring && ring_sync(qh) && qh->ring_len) {
+        it->ring = qh->ring;
+        it->pos = qh->ring_first;
+        it->mask = qh->ring_cap - 1;
+        it->left = qh->ring_len;
+        return it->ring[it->pos];
+    }
+    if (qh->unrolled && chunks_sync(qh) && !list_empty(&qh->chunks)) {
+        it->chunk = chunks_first(qh);
+        it->slot = it->chunk->begin;
+        return it->chunk->slot[it->slot];
+    }
+    return q_iter_next(it);
+}
+
+/* Node at 1-based position pos of a queue of size nodes, straight from its
+ * ring or skipping whole chunks if it has them, or walking from the nearer end
+ */
+static struct list_head *q_nth(struct list_head *head, int size, int pos)
+{
+    queue_head_t *qh = q_head(head);
+    if (pos > 0 && qh->use_ring && ring_sync(qh))
+        return &(*ring_at(qh, pos - 1))->list;
+    if (pos > 0 && qh->unrolled && chunks_sync(qh)) {
+        int index = pos - 1;
+        q_chunk_t *c = chunks_find(qh, &index);
+        return &c->slot[index]->list;
+    }
+
+    struct list_head *node = head;
+    if (pos <= size / 2) {
+        while (pos--)
+            node = node->next;
+    } else {
+        for (pos = size - pos; pos; pos--)
+            node = node->prev;
+        node = node->prev;
+    }
+    return node;
+}
+
+/* Cut up to n elements off the head of queue into out */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *out)
+{
+    INIT_LIST_HEAD(out);
+    if (!head || list_empty(head) || n <= 0)
+        return 0;
+
+    int size = q_size(head);
+    if (n >= size) {
+        list_splice_init(head, out);
+        n = size;
+    } else {
+        list_cut_position(out, head, q_nth(head, size, n));
+    }
+    q_head(head)->size -= n;
+    mid_forget(head);
+    chunks_drop(q_head(head), n, true);
+    ring_drop(q_head(head), n, true);
+
+    return n;
+}
+
+/* Cut up to n elements off the tail of queue into out */
+int q_remove_tail_n(struct list_head *head, int n, struct list_head *out)
+{
+    INIT_LIST_HEAD(out);
+    if (!head || list_empty(head) || n <= 0)
+        return 0;
+
+    int size = q_size(head);
+    if (n >= size) {
+        list_splice_init(head, out);
+        n = size;
+    } else {
+        /* Set the kept front aside, the rest is what goes */
+        LIST_HEAD(keep);
+        list_cut_position(&keep, head, q_nth(head, size, size - n));
+        list_splice_init(head, out);
+        list_splice(&keep, head);
+    }
+    q_head(head)->size -= n;
+    mid_forget(head);
+    chunks_drop(q_head(head), n, false);
+    ring_drop(q_head(head), n, false);
+
+    return n;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return q_head(head)->size;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
+    if (!head || list_empty(head)) {
+        return false;
+    }
+
+    /* find mid, unless it is tracked already */
+    queue_head_t *qh = q_head(head);
+    struct list_head *mid = qh->mid;
+    if (!mid) {
+        int index = (qh->size - 1) / 2;
+        mid = q_nth(head, qh->size, index + 1);
+        if (qh->track_mid) {
+            qh->mid = mid;
+            qh->mid_index = index;
+        }
+    }
+
+    /* unlink and free entry */
+    q_unlink(head, mid, (qh->size - 1) / 2);
+    q_release_element(list_entry(mid, element_t, list));
+
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    if (!head || list_empty(head)) {
+        return false;
+    }
+
+    if (list_is_singular(head)) {
+        return true;
+    }
+
+    order_forget(head);
+
+    /* Equal interned strings are the same string */
+    bool interned = q_head(head)->intern;
+    element_t *entry, *safe, *first_appear;
+    entry = safe = first_appear = NULL;
+    int dup_flag = 0;
+    list_for_each_entry_safe (entry, safe, head, list) {
+        if (first_appear &&
+            (interned ? first_appear->value == entry->value
+                      : strcmp(first_appear->value, entry->value) == 0)) {
+            // duplicated
+            dup_flag += 1;
+            list_del(&(entry->list));
+            q_release_element(entry);
+            q_head(head)->size--;
+        } else {
+            if (dup_flag && first_appear) {
+                list_del(&(first_appear->list));
+                q_release_element(first_appear);
+                q_head(head)->size--;
+            }
+            dup_flag = 0;
+            first_appear = entry;
+        }
+    }
+
+    if (dup_flag != 0) {
+        list_del(&(first_appear->list));
+        q_release_element(first_appear);
+        q_head(head)->size--;
+    }
+
+    return true;
+}
+
+/* Slot of the q_delete_dup_hash() table, empty while @entry is NULL */
+struct dup_slot {
+    element_t *entry;
+    uint64_t hash;
+    bool dup;
+};
+
+/* Delete all nodes whose string appears more than once, keeping the order */
+bool q_delete_dup_hash(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    /* At most half full, so linear probing stays short */
+    size_t mask = 1;
+    while (mask < 2 * (size_t) q_size(head))
+        mask <<= 1;
+    struct dup_slot *table = calloc(mask, sizeof(*table));
+    if (!table)
+        return false;
+    mask--;
+
+    order_forget(head);
+
+    /* Later copies are released right away, first ones are only marked */
+    element_t *entry, *safe;
+    list_for_each_entry_safe (entry, safe, head, list) {
+        uint64_t hash = str_hash(entry->value);
+        struct dup_slot *slot;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            slot = &table[i];
+            if (!slot->entry || (slot->hash == hash &&
+                                 !strcmp(slot->entry->value, entry->value)))
+                break;
+        }
+        if (!slot->entry) {
+            slot->entry = entry;
+            slot->hash = hash;
+        } else {
+            slot->dup = true;
+            list_del(&entry->list);
+            q_release_element(entry);
+            q_head(head)->size--;
+        }
+    }
+
+    for (size_t i = 0; i <= mask; i++) {
+        if (table[i].dup) {
+            list_del(&table[i].entry->list);
+            q_release_element(table[i].entry);
+            q_head(head)->size--;
+        }
+    }
+    free(table);
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    // https://leetcode.com/problems/swap-nodes-in-pairs/
+    q_reverseK(head, 2);
+}
+
+/* Reverse the circular list around head, which need not be a queue head */
+static void reverse_list(struct list_head *head)
+{
+    struct list_head *node, *safe, *tmp;
+    list_for_each_safe (node, safe, head) {
+        tmp = node->next;
+        node->next = node->prev;
+        node->prev = tmp;
+    }
+    tmp = head->next;
+    head->next = head->prev;
+    head->prev = tmp;
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return;
+    queue_head_t *qh = q_head(head);
+    if (qh->use_ring && qh->ring_valid) {
+        /* Relinking from the ring saves chasing the links */
+        ring_reverse(qh, 0, qh->ring_len - 1);
+        ring_relink(qh);
+    } else {
+        reverse_list(head);
+    }
+    chunks_forget(head);
+
+    /* The middle node ends up at the mirrored index */
+    if (qh->mid) {
+        qh->mid_index = qh->size - 1 - qh->mid_index;
+        mid_seek(qh);
+    }
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    // https://leetcode.com/problems/reverse-nodes-in-k-group/
+    if (k <= 0 || !head || list_empty(head)) {
+        return;
+    }
+
+    /* Each full group is cut off after the groups done, reversed on its own
+     * and spliced back in place, so it costs three list operations whatever
+     * k is. Whatever is left is shorter than k and stays as it is.
+     */
+    int groups = q_size(head) / k;
+    if (k == 1 || !groups)
+        return;
+
+    queue_head_t *qh = q_head(head);
+    if (qh->use_ring && qh->ring_valid) {
+        /* Reverse the groups in the ring, then relink in one pass */
+        for (int g = 0; g < groups; g++)
+            ring_reverse(qh, g * k, g * k + k - 1);
+        ring_relink(qh);
+        mid_forget(head);
+        chunks_forget(head);
+        return;
+    }
+    order_forget(head);
+
+    LIST_HEAD(group);
+    struct list_head *tail = head; /* Last node of the groups done */
+    while (groups--) {
+        struct list_head *first = tail->next, *last = first;
+        for (int i = 1; i < k; i++)
+            last = last->next;
+        list_cut_position(&group, tail, last);
+        reverse_list(&group);
+        list_splice(&group, tail);
+        tail = first;
+    }
+}
+
+/* Compare the strings of two nodes in the requested sort order */
+static inline int cmp_node(const struct list_head *a,
+                           const struct list_head *b,
+                           bool descend)
+{
+    const char *sa = list_entry(a, element_t, list)->value;
+    const char *sb = list_entry(b, element_t, list)->value;
+    return descend ? strcmp(sb, sa) : strcmp(sa, sb);
+}
+
+/* A sorted, NULL-terminated run waiting on the merge stack */
+struct run {
+    struct list_head *head, *tail;
+    size_t len;
+};
+
+/* Pending run lengths grow at least like Fibonacci numbers, so this is
+ * far more than any queue whose size fits in an int can need.
+ */
+#define MAX_PENDING_RUNS 85
+
+/* Consecutive wins from one side before the merge starts galloping */
+#define MIN_GALLOP 7
+
+/* Return the last node of the NULL-terminated list @node that sorts before
+ * @key (or ties with it when @inclusive is set), probing exponentially and
+ * then binary searching, so a block of m nodes costs O(log m) comparisons.
+ * @node itself must satisfy the condition.
+ */
+static struct list_head *gallop(struct list_head *node,
+                                const struct list_head *key,
+                                bool inclusive,
+                                bool descend)
+{
+    struct list_head *lo = node;
+    size_t step = 1;
+
+    /* Exponential probe: lo satisfies, the node step hops past it may not */
+    while (1) {
+        struct list_head *hi = lo;
+        size_t i;
+        for (i = 0; i < step && hi->next; i++)
+            hi = hi->next;
+        if (!i)
+            return lo;
+        int c = cmp_node(hi, key, descend);
+        if (c < 0 || (inclusive && !c)) {
+            lo = hi;
+            step <<= 1;
+            continue;
+        }
+        step = i;
+        break;
+    }
+
+    /* Binary search: the answer lies in the next step - 1 nodes after lo */
+    while (step > 1) {
+        size_t half = step >> 1;
+        struct list_head *mid = lo;
+        for (size_t i = 0; i < half; i++)
+            mid = mid->next;
+        int c = cmp_node(mid, key, descend);
+        if (c < 0 || (inclusive && !c)) {
+            lo = mid;
+            step -= half;
+        } else {
+            step = half;
+        }
+    }
+    return lo;
+}
+
+/* Stable merge of run b into run a, which precedes it in the input */
+static void merge_runs(struct run *a, const struct run *b, bool descend)
+{
+    /* Runs that are already in order just get concatenated */
+    if (cmp_node(a->tail, b->head, descend) <= 0) {
+        a->tail->next = b->head;
+        a->tail = b->tail;
+        a->len += b->len;
+        return;
+    }
+    if (cmp_node(b->tail, a->head, descend) < 0) {
+        b->tail->next = a->head;
+        a->head = b->head;
+        a->len += b->len;
+        return;
+    }
+
+    struct list_head *l1 = a->head, *l2 = b->head;
+    struct list_head *head = NULL, **ptr = &head;
+    struct list_head *tail = NULL;
+    int wins1 = 0, wins2 = 0;
+    while (l1 && l2) {
+        if (cmp_node(l1, l2, descend) <= 0) {
+            struct list_head *last = l1;
+            if (++wins1 >= MIN_GALLOP)
+                last = cmp_node(a->tail, l2, descend) <= 0
+                           ? a->tail
+                           : gallop(l1, l2, true, descend);
+            wins2 = 0;
+            *ptr = l1;
+            l1 = last->next;
+            ptr = &last->next;
+        } else {
+            struct list_head *last = l2;
+            if (++wins2 >= MIN_GALLOP)
+                last = cmp_node(b->tail, l1, descend) < 0
+                           ? b->tail
+                           : gallop(l2, l1, false, descend);
+            wins1 = 0;
+            *ptr = l2;
+            l2 = last->next;
+            ptr = &last->next;
+        }
+    }
+    if (l1) {
+        *ptr = l1;
+        tail = a->tail;
+    } else {
+        *ptr = l2;
+        tail = b->tail;
     }
-    strncpy(element->value, s, strlen(s));
-    element->value[strlen(s)] = '\0';
-
-    struct list_head *next = head->next;
-    next->prev = &(element->list);
-    element->list.next = next;
-    element->list.prev = head;
-    head->next = &(element->list);
 
-    return true;
+    a->head = head;
+    a->tail = tail;
+    a->len += b->len;
 }
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+/* Merge runs[i] and runs[i + 1] into runs[i] */
+static void merge_at(struct run *runs, size_t *n, size_t i, bool descend)
 {
-    if (!head)
-        return false;
+    merge_runs(&runs[i], &runs[i + 1], descend);
+    if (i + 2 < *n)
+        runs[i + 1] = runs[i + 2];
+    (*n)--;
+}
 
-    element_t *element = malloc(sizeof(element_t));
-    if (!element)
-        return false;
-    element->value = malloc(strlen(s) + 1);
-    if (!element->value) {
-        free(element);
-        return false;
+/* Keep the pending run lengths shaped so the stack stays O(log n) deep */
+static void merge_collapse(struct run *runs, size_t *n, bool descend)
+{
+    while (*n > 1) {
+        size_t i = *n - 2;
+        if ((i > 0 && runs[i - 1].len <= runs[i].len + runs[i + 1].len) ||
+            (i > 1 && runs[i - 2].len <= runs[i - 1].len + runs[i].len)) {
+            if (runs[i - 1].len < runs[i + 1].len)
+                i--;
+        } else if (runs[i].len > runs[i + 1].len) {
+            break;
+        }
+        merge_at(runs, n, i, descend);
     }
-    strncpy(element->value, s, strlen(s));
-    element->value[strlen(s)] = '\0';
-
-    struct list_head *tail = head->prev;
-    tail->next = &(element->list);
-    head->prev = &(element->list);
-    element->list.next = head;
-    element->list.prev = tail;
-
-    return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/* Short runs are extended to this many nodes by insertion */
+static size_t min_run(size_t n)
 {
-    if (!head || list_empty(head)) {
-        return NULL;
+    size_t r = 0;
+    while (n >= 16) {
+        r |= n & 1;
+        n >>= 1;
     }
+    return n + r;
+}
 
-    element_t *element = list_first_entry(head, element_t, list);
-    if (sp) {
-        strncpy(sp, element->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+/* Cut the longest sorted prefix off the NULL-terminated list at *list,
+ * reversing it if it is descending, and extend it with insertion up to
+ * @minrun nodes.
+ */
+static void next_run(struct list_head **list,
+                     struct run *run,
+                     size_t minrun,
+                     bool descend)
+{
+    struct list_head *head = *list, *tail = head, *next = head->next;
+    size_t len = 1;
+
+    int c = next ? cmp_node(head, next, descend) : 0;
+    if (c > 0) {
+        /* Descending: reverse it while scanning, but keep each group of equal
+         * nodes in input order so the sort stays stable
+         */
+        struct list_head *last = head;
+        head->next = NULL;
+        do {
+            struct list_head *after = next->next;
+            if (c) {
+                next->next = head;
+                head = next;
+            } else {
+                next->next = last->next;
+                last->next = next;
+                if (last == tail)
+                    tail = next;
+            }
+            last = next;
+            next = after;
+            len++;
+        } while (next && (c = cmp_node(last, next, descend)) >= 0);
+    } else if (next) {
+        do {
+            tail = next;
+            next = next->next;
+            len++;
+        } while (next && cmp_node(tail, next, descend) <= 0);
+    }
+    tail->next = NULL;
+
+    /* Stable insertion of the following nodes */
+    while (len < minrun && next) {
+        struct list_head *node = next;
+        next = next->next;
+        if (cmp_node(tail, node, descend) <= 0) {
+            tail->next = node;
+            tail = node;
+        } else {
+            struct list_head **pos = &head;
+            while (cmp_node(*pos, node, descend) <= 0)
+                pos = &(*pos)->next;
+            node->next = *pos;
+            *pos = node;
+        }
+        tail->next = NULL;
+        len++;
     }
 
-    struct list_head *next = element->list.next;
-    head->next = next;
-    next->prev = head;
-    INIT_LIST_HEAD(&(element->list));
-
-    return element;
+    run->head = head;
+    run->tail = tail;
+    run->len = len;
+    *list = next;
 }
 
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+/* Natural merge sort of the NULL-terminated list in @run: split it into
+ * already sorted runs in one pass and merge them through a stack of pending
+ * runs, so sorted or nearly sorted input costs O(n).
+ */
+static void merge_sort_list(struct run *run, bool descend)
 {
-    if (!head || list_empty(head)) {
-        return NULL;
+    struct run runs[MAX_PENDING_RUNS];
+    size_t n = 0, minrun = min_run(run->len);
+    struct list_head *list = run->head;
+    while (list) {
+        next_run(&list, &runs[n++], minrun, descend);
+        merge_collapse(runs, &n, descend);
     }
-
-    element_t *element = list_last_entry(head, element_t, list);
-    if (sp) {
-        strncpy(sp, element->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+    while (n > 1) {
+        size_t i = n - 2;
+        if (i > 0 && runs[i - 1].len < runs[i + 1].len)
+            i--;
+        merge_at(runs, &n, i, descend);
     }
+    *run = runs[0];
+}
 
-    struct list_head *prev = element->list.prev;
-    head->prev = prev;
-    prev->next = head;
-    INIT_LIST_HEAD(&(element->list));
+/* A node and the first bytes of its string packed big-endian, so comparing
+ * two keys as integers orders them like strcmp() on those bytes.
+ */
+struct key_entry {
+    uint64_t key;
+    struct list_head *node;
+};
 
-    return element;
+static inline uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+    int i = 0;
+    for (; i < 8 && s[i]; i++)
+        key = (key << 8) | (unsigned char) s[i];
+    return i ? key << (8 * (8 - i)) : 0;
 }
 
-/* Return number of elements in queue */
-int q_size(struct list_head *head)
+/* Compare two entries, falling back to strcmp() only on a full prefix tie */
+static inline int cmp_key(const struct key_entry *a,
+                          const struct key_entry *b,
+                          bool descend)
 {
-    if (!head)
+    if (a->key != b->key)
+        return ((a->key < b->key) ^ descend) ? -1 : 1;
+    /* A NUL inside the prefix means both strings end at the same place */
+    if (!(a->key & 0xff))
         return 0;
-
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        len++;
-    return len;
+    return cmp_node(a->node, b->node, descend);
 }
 
-/* Delete the middle node in queue */
-bool q_delete_mid(struct list_head *head)
+/* Stable merge sort of @n entries in @a, using @tmp as scratch */
+static void key_sort(struct key_entry *a,
+                     struct key_entry *tmp,
+                     size_t n,
+                     bool descend)
 {
-    // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    if (!head || list_empty(head)) {
-        return false;
+    /* Insertion sort small blocks first */
+    for (size_t lo = 0; lo < n; lo += 16) {
+        size_t hi = lo + 16 < n ? lo + 16 : n;
+        for (size_t i = lo + 1; i < hi; i++) {
+            struct key_entry e = a[i];
+            size_t j = i;
+            for (; j > lo && cmp_key(&a[j - 1], &e, descend) > 0; j--)
+                a[j] = a[j - 1];
+            a[j] = e;
+        }
     }
 
-    /* find mid */
-    struct list_head *fast, *slow;
-    fast = slow = head;
-    do {
-        slow = slow->next;
-        fast = fast->next->next;
-    } while (fast != head && fast->next != head);
-
-    /* connect list */
-    struct list_head *next = slow->next, *prev = slow->prev;
-    next->prev = prev;
-    prev->next = next;
-
-    /* free entry */
-    element_t *element = list_entry(slow, element_t, list);
-    if (!element)
-        return false;
-    if (element->value)
-        free(element->value);
-    free(element);
-
-    return true;
+    struct key_entry *src = a, *dst = tmp;
+    for (size_t width = 16; width < n; width <<= 1) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = mid + width < n ? mid + width : n;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi)
+                dst[k++] = cmp_key(&src[j], &src[i], descend) < 0 ? src[j++]
+                                                                   : src[i++];
+            while (i < mid)
+                dst[k++] = src[i++];
+            while (j < hi)
+                dst[k++] = src[j++];
+        }
+        struct key_entry *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != a)
+        memcpy(a, src, n * sizeof(*a));
 }
 
-/* Delete all nodes that have duplicate string */
-bool q_delete_dup(struct list_head *head)
+/* Sort the NULL-terminated list in @run through a contiguous array of
+ * prefix keys, so most comparisons touch neither the nodes nor their
+ * strings, then relink it in one pass. The array is scratch memory from
+ * malloc(), freed before returning.
+ *
+ * Return: false if no scratch memory was available, list left untouched
+ */
+static bool key_sort_list(struct run *run, bool descend)
 {
-    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
-    if (!head || list_empty(head)) {
+    size_t n = run->len;
+    struct key_entry *keys = malloc(2 * n * sizeof(struct key_entry));
+    if (!keys)
         return false;
-    }
-
-    if (list_is_singular(head)) {
-        return true;
-    }
 
-    element_t *entry, *safe, *first_appear;
-    entry = safe = first_appear = NULL;
-    int dup_flag = 0;
-    list_for_each_entry_safe (entry, safe, head, list) {
-        if (first_appear && strcmp(first_appear->value, entry->value) == 0) {
-            // duplicated
-            dup_flag += 1;
-            list_del(&(entry->list));
-            q_release_element(entry);
-        } else {
-            if (dup_flag && first_appear) {
-                list_del(&(first_appear->list));
-                q_release_element(first_appear);
-            }
-            dup_flag = 0;
-            first_appear = entry;
-        }
+    size_t i = 0;
+    bool sorted = true;
+    for (struct list_head *node = run->head; node; node = node->next) {
+        keys[i].key = key_prefix(list_entry(node, element_t, list)->value);
+        keys[i].node = node;
+        if (i && sorted && cmp_key(&keys[i - 1], &keys[i], descend) > 0)
+            sorted = false;
+        i++;
     }
 
-    if (dup_flag != 0) {
-        list_del(&(first_appear->list));
-        q_release_element(first_appear);
+    if (!sorted) {
+        key_sort(keys, keys + n, n, descend);
+        for (i = 0; i + 1 < n; i++)
+            keys[i].node->next = keys[i + 1].node;
+        keys[n - 1].node->next = NULL;
+        run->head = keys[0].node;
+        run->tail = keys[n - 1].node;
     }
 
+    free(keys);
     return true;
 }
 
-/* Swap every two adjacent nodes */
-void q_swap(struct list_head *head)
+/* Buckets at most this large are finished by insertion sort */
+#define RADIX_INSERTION 16
+
+/* Buckets still unresolved after this many bytes go to the merge sort */
+#define RADIX_MAX_DEPTH 64
+
+/* Compare two strings already known to share their first @depth bytes */
+static inline int cmp_from(const struct list_head *a,
+                           const struct list_head *b,
+                           size_t depth,
+                           bool descend)
 {
-    // https://leetcode.com/problems/swap-nodes-in-pairs/
-    q_reverseK(head, 2);
+    const char *sa = list_entry(a, element_t, list)->value + depth;
+    const char *sb = list_entry(b, element_t, list)->value + depth;
+    return descend ? strcmp(sb, sa) : strcmp(sa, sb);
 }
 
-/* Reverse elements in queue */
-void q_reverse(struct list_head *head)
+/* Stable insertion sort of a short bucket */
+static void radix_insertion(struct run *run, size_t depth, bool descend)
 {
-    if (!head || list_empty(head))
-        return;
-    struct list_head *node, *safe, *tmp;
-    list_for_each_safe (node, safe, head) {
-        tmp = node->next;
-        node->next = node->prev;
-        node->prev = tmp;
+    struct list_head *head = run->head, *tail = head, *next = head->next;
+    tail->next = NULL;
+    while (next) {
+        struct list_head *node = next;
+        next = next->next;
+        if (cmp_from(tail, node, depth, descend) <= 0) {
+            tail->next = node;
+            tail = node;
+        } else {
+            struct list_head **pos = &head;
+            while (cmp_from(*pos, node, depth, descend) <= 0)
+                pos = &(*pos)->next;
+            node->next = *pos;
+            *pos = node;
+        }
+        tail->next = NULL;
     }
-    tmp = head->next;
-    head->next = head->prev;
-    head->prev = tmp;
+    run->head = head;
+    run->tail = tail;
 }
 
-/* Reverse the nodes of the list k at a time */
-void q_reverseK(struct list_head *head, int k)
+/* MSD radix sort of the NULL-terminated list in @run, whose strings share
+ * their first @depth bytes. Nodes are distributed into buckets by the byte
+ * at @depth, appended so equal keys keep their input order, and the buckets
+ * are sorted recursively and concatenated.
+ */
+static void radix_sort_list(struct run *run, size_t depth, bool descend)
 {
-    // https://leetcode.com/problems/reverse-nodes-in-k-group/
-    if (k <= 0 || !head || list_empty(head)) {
+    if (run->len <= RADIX_INSERTION) {
+        radix_insertion(run, depth, descend);
         return;
     }
-    int end = 0;
-    struct list_head *fast, *slow;
-    fast = head;
-    while (1) {
-        slow = fast->next;
-        for (int i = 0; i < k; ++i) {
-            fast = fast->next;
-            if (fast == head) {
-                end = 1;
-                break;
-            }
-        }
-        if (end)
-            break;
+    if (depth >= RADIX_MAX_DEPTH) {
+        merge_sort_list(run, descend);
+        return;
+    }
+
+    struct run buckets[256];
+    memset(buckets, 0, sizeof(buckets));
+    for (struct list_head *node = run->head, *next; node; node = next) {
+        unsigned char c = list_entry(node, element_t, list)->value[depth];
+        struct run *b = &buckets[c];
+        next = node->next;
+        node->next = NULL;
+        if (b->len)
+            b->tail->next = node;
+        else
+            b->head = node;
+        b->tail = node;
+        b->len++;
+    }
+
+    /* Strings that ended at @depth are all equal, so bucket 0 is done */
+    struct list_head *head = NULL, **ptr = &head, *tail = NULL;
+    for (int i = 0; i < 256; i++) {
+        struct run *b = &buckets[descend ? 255 - i : i];
+        if (!b->len)
+            continue;
+        if (b != &buckets[0] && b->len > 1)
+            radix_sort_list(b, depth + 1, descend);
+        *ptr = b->head;
+        ptr = &b->tail->next;
+        tail = b->tail;
+    }
+    run->head = head;
+    run->tail = tail;
+}
 
-        // save the position of the subqueue
-        struct list_head *before, *after;
-        before = slow->prev;
-        after = fast->next;
+/* Sort the NULL-terminated list in @run with the configured algorithm */
+static void sort_list(struct run *run, bool descend)
+{
+    if (q_radix_sort)
+        radix_sort_list(run, 0, descend);
+    else if (q_keysort_threshold <= 0 ||
+             run->len < (size_t) q_keysort_threshold ||
+             !key_sort_list(run, descend))
+        merge_sort_list(run, descend);
+}
 
-        // cut off the subqueue
-        slow->prev = fast;
-        fast->next = slow;
+/* Queues shorter than this per thread are not worth sorting in parallel */
+#define PARALLEL_MIN_PART 4096
 
-        // reverse and reconnect the subqueue
-        q_reverse(slow);
-        before->next = fast;
-        after->prev = slow;
-        fast->prev = before;
-        slow->next = after;
+/* Upper bound of the sort_threads option */
+#define PARALLEL_MAX_THREADS 64
 
-        // Reposition slow and fast pointers to the correct starting position
-        fast = slow;
-    }
+struct sort_task {
+    struct run *run, *other;
+    bool descend;
+};
+
+static void *sort_worker(void *arg)
+{
+    struct sort_task *task = arg;
+    sort_list(task->run, task->descend);
+    return NULL;
 }
 
-struct list_head *forward(struct list_head *head, int step)
+static void *merge_worker(void *arg)
 {
-    struct list_head *node = head, *prev;
-    do {
-        prev = node;
-        node = node->next;
-        if (!node)
-            break;
-    } while (--step);
+    struct sort_task *task = arg;
+    merge_runs(task->run, task->other, task->descend);
+    return NULL;
+}
 
-    return prev;
+/* Run @fn over @n tasks of @size bytes each, one thread per task. SIGALRM
+ * stays blocked until every worker has been joined, so qtest's time limit
+ * fires on the calling thread and never unwinds past running workers. A task
+ * whose thread cannot be created runs on the caller instead.
+ */
+static void run_tasks(void *tasks,
+                      size_t size,
+                      int n,
+                      void *(*fn)(void *))
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    bool started[PARALLEL_MAX_THREADS];
+    char *task = tasks;
+    for (int i = 1; i < n; i++)
+        started[i] = !pthread_create(&threads[i], NULL, fn, task + i * size);
+
+    fn(task);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(task + i * size);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-int merge(struct list_head **head,
-          struct list_head *l1,
-          struct list_head *l2,
-          int descend)
+/* Merge the @n sorted runs in @parts into parts[0] by rounds of pairwise
+ * merges. The merges of a round run in parallel and are joined before the
+ * next round starts. Only neighbouring runs are merged, earlier one first,
+ * so the result is the same as merging them one by one.
+ */
+static void merge_parts(struct run *parts, int n, bool descend)
 {
-    struct list_head *prev = *head;
-    struct list_head **ptr = &(*head)->next, **node;
-    for (node = NULL; l1 && l2; *node = (*node)->next) {
-        if (descend) {
-            node = (strcmp(list_entry(l1, element_t, list)->value,
-                           list_entry(l2, element_t, list)->value) >= 0)
-                       ? &l1
-                       : &l2;
-        } else {
-            node = (strcmp(list_entry(l1, element_t, list)->value,
-                           list_entry(l2, element_t, list)->value) <= 0)
-                       ? &l1
-                       : &l2;
+    struct sort_task tasks[PARALLEL_MAX_THREADS];
+    for (int width = 1; width < n; width <<= 1) {
+        int m = 0;
+        for (int i = 0; i + width < n; i += 2 * width, m++) {
+            tasks[m].run = &parts[i];
+            tasks[m].other = &parts[i + width];
+            tasks[m].descend = descend;
         }
-        *ptr = *node;
-        (*node)->prev = prev;
-        prev = *node;
-        ptr = &(*ptr)->next;
+        run_tasks(tasks, sizeof(*tasks), m, merge_worker);
     }
+}
 
+/* Cut the list in @run into @n contiguous parts, sort each on its own
+ * thread, then merge them back with merge_parts(), which keeps the result
+ * as stable as the sequential sort.
+ */
+static void parallel_sort_list(struct run *run, int n, bool descend)
+{
+    struct run parts[PARALLEL_MAX_THREADS];
+    struct sort_task tasks[PARALLEL_MAX_THREADS];
+    struct list_head *node = run->head;
+    size_t left = run->len;
+
+    for (int i = 0; i < n; i++) {
+        size_t len = left / (n - i);
+        parts[i].head = node;
+        parts[i].len = len;
+        for (size_t j = 1; j < len; j++)
+            node = node->next;
+        parts[i].tail = node;
+        node = node->next;
+        parts[i].tail->next = NULL;
+        left -= len;
 
+        tasks[i].run = &parts[i];
+        tasks[i].descend = descend;
+    }
+    run_tasks(tasks, sizeof(*tasks), n, sort_worker);
+    merge_parts(parts, n, descend);
+    *run = parts[0];
+}
 
-    if (l1) {
-        *ptr = l1;
-        l1->prev = prev;
-
-        return 1;
-    } else {
-        *ptr = l2;
-        l2->prev = prev;
-
-        return 2;
+/* Link the NULL-terminated list @first into the empty queue @head, restoring
+ * the prev pointers and closing the circle
+ */
+static void attach_list(struct list_head *head, struct list_head *first)
+{
+    struct list_head *prev = head, *node;
+    for (node = first; node; node = node->next) {
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
     }
+    prev->next = head;
+    head->prev = prev;
 }
 
 /* Sort elements of queue in ascending/descending order */
@@ -340,83 +1910,107 @@ void q_sort(struct list_head *head, bool descend)
         return;
     }
 
-    int step = 1;
-    int n = q_size(head) - 1;
+    queue_head_t *qh = q_head(head);
+    bool ring = qh->use_ring && qh->ring_valid;
+    order_forget(head);
+    int size = q_size(head);
+    int threads = q_sort_threads;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    if (threads > size / PARALLEL_MIN_PART)
+        threads = size / PARALLEL_MIN_PART;
+
+    struct run run = {.head = head->next, .tail = head->prev, .len = size};
     head->prev->next = NULL;
-    for (; n != 0; n >>= 1, step <<= 1) {
-        // maintain only single direction
-        struct list_head *l1, *l2, *before, *after, *l1_tail, *l2_tail;
-        before = head;
-        while (1) {
-            l1 = before->next;
-            if (!l1)
-                break;
-            l1_tail = forward(l1, step);  // make sure forward won't return NULL
-            l2 = l1_tail->next;
-            if (!l2)
-                break;
-            l2_tail = forward(l2, step);
-            after = l2_tail->next;
-            l1_tail->next = NULL;
-            l2_tail->next = NULL;
-
-            int end_with = merge(&before, l1, l2, descend);
-            if (!after) {
-                break;
-            }
-
-            if (end_with == 1) {
-                after->prev = l1_tail;
-                l1_tail->next = after;
-            } else {
-                after->prev = l2_tail;
-                l2_tail->next = after;
-            }
-
-            // prepare next loop
-            before = after->prev;
-        }
+    if (threads > 1)
+        parallel_sort_list(&run, threads, descend);
+    else
+        sort_list(&run, descend);
+    attach_list(head, run.head);
+    if (ring) {
+        qh->ring_valid = true;
+        ring_refill(qh);
     }
-    struct list_head *node;
-    for (node = head; node->next; node = node->next)
-        ;
-    node->next = head;
-    head->prev = node;
 }
 
-/* Remove every node which has a node with a strictly less value anywhere to
- * the right side of it */
-int q_ascend(struct list_head *head)
+/* strcmp() of the string of node a and b, given their key_prefix() values
+ * ka and kb. Node a is only looked at on a full prefix tie.
+ */
+static inline int cmp_prefixed(uint64_t ka,
+                               uint64_t kb,
+                               struct list_head *a,
+                               const char *b)
 {
-    // https://leetcode.com/problems/remove-nodes-from-linked-list/
-    if (!head || list_empty(head))
+    if (ka != kb)
+        return ka < kb ? -1 : 1;
+    /* A NUL inside the prefix means both strings end at the same place */
+    if (!(ka & 0xff))
         return 0;
-    if (list_is_singular(head))
-        return 1;
+    return strcmp(list_entry(a, element_t, list)->value + 8, b + 8);
+}
+
+/* Remove every node followed somewhere to its right by a node which is
+ * strictly less, or strictly greater when descend is set, in one pass. The
+ * list itself is the monotonic stack: survivors stay linked behind
+ * stack_head, so every node is pushed and popped at most once, and the
+ * stack depth at the end is the new size. With q_prefix_compare the
+ * prefixes of the stacked strings are kept in an array alongside, so most
+ * comparisons never reach strcmp().
+ */
+static int monotonic_filter(struct list_head *head, bool descend)
+{
+    uint64_t *keys = NULL;
+    if (q_prefix_compare)
+        keys = malloc(q_size(head) * sizeof(uint64_t));
 
+    order_forget(head);
     element_t *entry, *safe;
-    struct list_head *stack_head;
-    entry = safe = NULL;
-    stack_head = head;
+    struct list_head *stack_head = head;
+    int depth = 0;
     list_for_each_entry_safe (entry, safe, head, list) {
-        while (stack_head != head &&
-               strcmp(list_entry(stack_head, element_t, list)->value,
-                      entry->value) > 0) {
+        uint64_t key = keys ? key_prefix(entry->value) : 0;
+        while (depth) {
+            int c =
+                keys ? cmp_prefixed(keys[depth - 1], key, stack_head,
+                                    entry->value)
+                     : strcmp(list_entry(stack_head, element_t, list)->value,
+                              entry->value);
+            if (descend ? c >= 0 : c <= 0)
+                break;
             struct list_head *cur = stack_head;
             stack_head = cur->prev;
             stack_head->next = NULL;
             q_release_element(list_entry(cur, element_t, list));
+            depth--;
         }
         stack_head->next = &entry->list;
         entry->list.prev = stack_head;
         entry->list.next = NULL;
         stack_head = &entry->list;
+        if (keys)
+            keys[depth] = key;
+        depth++;
     }
 
     stack_head->next = head;
     head->prev = stack_head;
+    q_head(head)->size = depth;
+    free(keys);
+
+    return depth;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    // https://leetcode.com/problems/remove-nodes-from-linked-list/
+    if (!head || list_empty(head))
+        return 0;
+    if (list_is_singular(head))
+        return 1;
 
-    return q_size(head);
+    return monotonic_filter(head, false);
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
@@ -429,29 +2023,177 @@ int q_descend(struct list_head *head)
     if (list_is_singular(head))
         return 1;
 
-    element_t *entry, *safe;
-    struct list_head *stack_head;
-    entry = safe = NULL;
-    stack_head = head;
-    list_for_each_entry_safe (entry, safe, head, list) {
-        while (stack_head != head &&
-               strcmp(list_entry(stack_head, element_t, list)->value,
-                      entry->value) < 0) {
-            struct list_head *cur = stack_head;
-            stack_head = cur->prev;
-            stack_head->next = NULL;
-            q_release_element(list_entry(cur, element_t, list));
+    return monotonic_filter(head, true);
+}
+
+/* Sorted lists a single loser tree merges at once, kept on the stack */
+#define MERGE_MAX_WAYS 1024
+
+/* Loser tree over the fronts of up to MERGE_MAX_WAYS sorted lists. tree[0]
+ * holds the index of the list whose front node comes next, tree[t] the loser
+ * of the match played at internal node t. Exhausted lists lose every match
+ * and ties go to the lower index, so the merge is stable.
+ */
+struct loser_tree {
+    struct list_head *front[MERGE_MAX_WAYS];
+    int tree[MERGE_MAX_WAYS];
+    int k;
+    bool descend;
+};
+
+/* Does list @a go before list @b? A negative index stands for a list that
+ * has not played yet and beats everything, which lets lt_build() fill the
+ * tree with the same replay used while merging.
+ */
+static bool lt_beats(const struct loser_tree *lt, int a, int b)
+{
+    if (a < 0)
+        return true;
+    if (b < 0 || !lt->front[a])
+        return false;
+    if (!lt->front[b])
+        return true;
+    int c = cmp_node(lt->front[a], lt->front[b], lt->descend);
+    return c < 0 || (!c && a < b);
+}
+
+/* Replay the matches on the path from list @s to the root */
+static void lt_replay(struct loser_tree *lt, int s)
+{
+    int winner = s;
+    for (int t = (s + lt->k) / 2; t > 0; t /= 2) {
+        if (lt_beats(lt, lt->tree[t], winner)) {
+            int loser = winner;
+            winner = lt->tree[t];
+            lt->tree[t] = loser;
         }
-        stack_head->next = &entry->list;
-        entry->list.prev = stack_head;
-        entry->list.next = NULL;
-        stack_head = &entry->list;
     }
+    lt->tree[0] = winner;
+}
 
-    stack_head->next = head;
-    head->prev = stack_head;
+/* Merge every list in @lt into the empty queue @out in one pass */
+static void lt_merge(struct loser_tree *lt, struct list_head *out)
+{
+    for (int i = 0; i < lt->k; i++)
+        lt->tree[i] = -1;
+    for (int s = lt->k - 1; s >= 0; s--)
+        lt_replay(lt, s);
+
+    struct list_head *tail = out;
+    for (int w = lt->tree[0]; lt->front[w]; w = lt->tree[0]) {
+        struct list_head *node = lt->front[w];
+        lt->front[w] = node->next;
+        tail->next = node;
+        node->prev = tail;
+        tail = node;
+        lt_replay(lt, w);
+    }
+    tail->next = out;
+    out->prev = tail;
+}
+
+/* Take all nodes off @q as a NULL-terminated list, leaving @q empty */
+static struct list_head *detach_list(struct list_head *q)
+{
+    order_forget(q);
+    if (list_empty(q))
+        return NULL;
+    struct list_head *first = q->next;
+    q->prev->next = NULL;
+    INIT_LIST_HEAD(q);
+    return first;
+}
+
+/* Lists merged by one loser tree of merge_lists_parallel() */
+struct merge_task {
+    struct run *lists;
+    int n;
+    bool descend;
+};
+
+/* Merge the lists of @arg into its first one through a loser tree */
+static void *merge_group_worker(void *arg)
+{
+    struct merge_task *task = arg;
+    struct loser_tree lt = {.k = task->n, .descend = task->descend};
+    struct list_head out;
+    size_t len = 0;
+    for (int i = 0; i < task->n; i++) {
+        lt.front[i] = task->lists[i].head;
+        len += task->lists[i].len;
+    }
+    lt_merge(&lt, &out);
+    task->lists[0].head = out.next;
+    task->lists[0].tail = out.prev;
+    task->lists[0].tail->next = NULL;
+    task->lists[0].len = len;
+    return NULL;
+}
 
-    return q_size(head);
+/* Merge the @n non-empty lists in @lists into lists[0]. They are cut into up
+ * to @threads contiguous groups, each merged on its own thread by a loser
+ * tree, and the groups are then merged pairwise by merge_parts(). Groups
+ * keep the input order and ties go to the earlier list everywhere, so the
+ * result is the same as the single loser tree's node for node.
+ */
+static void merge_lists_parallel(struct run *lists,
+                                 int n,
+                                 int threads,
+                                 bool descend)
+{
+    struct merge_task tasks[PARALLEL_MAX_THREADS];
+    struct run groups[PARALLEL_MAX_THREADS];
+    int g = n < threads ? n : threads;
+    for (int t = 0, start = 0; t < g; t++) {
+        int end = (int) ((long) n * (t + 1) / g);
+        tasks[t].lists = &lists[start];
+        tasks[t].n = end - start;
+        tasks[t].descend = descend;
+        start = end;
+    }
+    run_tasks(tasks, sizeof(*tasks), g, merge_group_worker);
+
+    for (int t = 0; t < g; t++)
+        groups[t] = tasks[t].lists[0];
+    merge_parts(groups, g, descend);
+    lists[0] = groups[0];
+}
+
+/* q_merge() for q_merge_threads > 1 */
+static int q_merge_parallel(struct list_head *head, int threads, bool descend)
+{
+    struct run lists[MERGE_MAX_WAYS];
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_contex_t *ctx;
+    int n = 0, total = 0;
+    list_for_each_entry (ctx, head, chain) {
+        if (list_empty(ctx->q))
+            continue;
+        if (ctx != first) {
+            q_head(first->q)->arena.mixed = true;
+            q_head(first->q)->intern &= q_head(ctx->q)->intern;
+        }
+        lists[n].len = q_size(ctx->q);
+        lists[n].tail = ctx->q->prev;
+        lists[n].head = detach_list(ctx->q);
+        total += lists[n].len;
+        q_head(ctx->q)->size = 0;
+        ctx->size = 0;
+        if (++n == MERGE_MAX_WAYS) {
+            merge_lists_parallel(lists, n, threads, descend);
+            n = 1;
+        }
+    }
+    if (!n)
+        return 0;
+    merge_lists_parallel(lists, n, threads, descend);
+
+    /* The first queue was only detached if it had nodes of its own */
+    order_forget(first->q);
+    attach_list(first->q, lists[0].head);
+    q_head(first->q)->size = total;
+    first->size = total;
+    return total;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -462,94 +2204,42 @@ int q_merge(struct list_head *head, bool descend)
     if (!head || list_empty(head)) {
         return 0;
     }
+    if (q_merge_threads > 1) {
+        int threads = q_merge_threads < PARALLEL_MAX_THREADS
+                          ? q_merge_threads
+                          : PARALLEL_MAX_THREADS;
+        return q_merge_parallel(head, threads, descend);
+    }
 
-    int k = 0;  // number of queue
-    queue_contex_t *e;
-    list_for_each_entry (e, head, chain)
-        k += (list_empty(e->q)) ? 0 : 1;
-
-    if (k == 0)
-        return 0;
-
-    queue_contex_t *qct1, *qct2;
-    qct1 = list_entry(head->next, queue_contex_t, chain);
-    if (list_empty(qct1->q)) {
-        list_for_each_entry (qct2, head, chain)
-            if (!list_empty(qct2->q))
-                break;
-
-        qct1->q->next = qct2->q->next;
-        qct1->q->prev = qct2->q->prev;
-        qct2->q->next->prev = qct1->q;
-        qct2->q->prev->next = qct1->q;
-
-        qct1->size = qct2->size;
-        qct2->size = 0;
-        INIT_LIST_HEAD(qct2->q);
-        qct1 = qct2 = NULL;
-    }
-
-    k--;
-    while (k != 0) {
-        k >>= 1;
-        queue_contex_t *entry = NULL, *qctx1 = NULL, *qctx2 = NULL;
-        list_for_each_entry (entry, head, chain) {
-            if (!qctx1 && !list_empty(entry->q)) {
-                qctx1 = entry;
-                continue;
-            }
-            if (list_empty(entry->q))
-                continue;
-
-            qctx2 = entry;
-
-
-            /* merge */
-            struct list_head *l1, *l2, *tmp_head = NULL, *prev = NULL;
-            struct list_head **ptr = &tmp_head, **node;
-            qctx1->q->prev->next = NULL;
-            qctx2->q->prev->next = NULL;
-            l1 = qctx1->q->next, l2 = qctx2->q->next;
-            for (node = NULL; l1 && l2; *node = (*node)->next) {
-                if (descend) {
-                    node = (strcmp(list_entry(l1, element_t, list)->value,
-                                   list_entry(l2, element_t, list)->value) < 0)
-                               ? &l2
-                               : &l1;
-                } else {
-                    node = (strcmp(list_entry(l1, element_t, list)->value,
-                                   list_entry(l2, element_t, list)->value) > 0)
-                               ? &l2
-                               : &l1;
-                }
-                *ptr = *node;
-                (*node)->prev = prev;
-                prev = *node;
-                ptr = &(*ptr)->next;
-            }
-
-            qctx1->q->next = tmp_head;
-            tmp_head->prev = qctx1->q;
-            if (!l1) {
-                *ptr = l2;
-                l2->prev = prev;
-                qctx1->q->prev = qctx2->q->prev;
-                qctx2->q->prev->next = qctx1->q;
-                INIT_LIST_HEAD(qctx2->q);
-            } else {
-                *ptr = l1;
-                l1->prev = prev;
-                qctx1->q->prev->next = qctx1->q;
-                INIT_LIST_HEAD(qctx2->q);
-            }
-
-            /* after merge */
-            qctx1->size += qctx2->size;
-            qctx2->size = 0;
-            INIT_LIST_HEAD(qctx2->q);
-            qctx1 = qctx2 = NULL;
+    /* All queues feed one loser tree, so every node is linked into the first
+     * queue exactly once. The first queue is always list 0, and with more
+     * than MERGE_MAX_WAYS queues the output so far becomes list 0 of the next
+     * batch, which keeps the result stable.
+     */
+    struct loser_tree lt = {.k = 1, .descend = descend};
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_contex_t *ctx;
+    int total = q_size(first->q);
+    lt.front[0] = detach_list(first->q);
+    list_for_each_entry (ctx, head, chain) {
+        if (ctx == first || list_empty(ctx->q))
+            continue;
+        q_head(first->q)->arena.mixed = true;
+        q_head(first->q)->intern &= q_head(ctx->q)->intern;
+        total += q_size(ctx->q);
+        lt.front[lt.k++] = detach_list(ctx->q);
+        q_head(ctx->q)->size = 0;
+        ctx->size = 0;
+        if (lt.k == MERGE_MAX_WAYS) {
+            lt_merge(&lt, first->q);
+            lt.front[0] = detach_list(first->q);
+            lt.k = 1;
         }
     }
-    queue_contex_t *qctx = list_entry(head->next, queue_contex_t, chain);
-    return q_size(qctx->q);
+    if (lt.front[0] || lt.k > 1)
+        lt_merge(&lt, first->q);
+
+    q_head(first->q)->size = total;
+    first->size = total;
+    return total;
 }
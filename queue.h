@@ -9,22 +9,236 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Ways an element and its string can be laid out, see element_t */
+enum {
+    Q_ELEMENT_SEPARATE, /* the string has a block of its own */
+    Q_ELEMENT_INLINE,   /* the string is in @inline_value */
+    Q_ELEMENT_SLAB,     /* the element is part of a slab */
+    Q_ELEMENT_INTERN,   /* the string is in the pool of q_intern */
+};
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @layout: how the element and its string were allocated, a Q_ELEMENT_* value
+ * @inline_value: storage for the string when it shares the element's block
+ *
+ * @value needs to be explicitly allocated and freed, unless @layout says
+ * otherwise. A %Q_ELEMENT_INLINE string was allocated together with the
+ * element and is released along with it.
+ *
+ * With q_sso set, every element is allocated with %Q_SSO_SIZE bytes of
+ * @inline_value. Strings that fit there are stored inline, longer ones get
+ * a block of their own as usual.
  *
- * @value needs to be explicitly allocated and freed
+ * A %Q_ELEMENT_SLAB element starts its @inline_value with a pointer to its
+ * slab, followed by the string. A %Q_ELEMENT_INTERN element starts it with a
+ * pointer to the slab it was allocated from, or %NULL if it was allocated on
+ * its own.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    unsigned char layout;
+    char inline_value[];
 } element_t;
 
+/**
+ * q_slab_t - Block shared by several elements
+ * @refs: number of elements in the block not released yet, plus one while
+ *        it is the newest chunk of an arena
+ * @link: node in the list of chunks of an arena, or linked to itself
+ *
+ * Bulk insertions and arena-backed queues allocate elements this way. Each
+ * element of a slab starts its @inline_value with a pointer back to the slab,
+ * followed by the string. The block is unlinked and freed once @refs drops to
+ * zero, so an arena only keeps the chunks that still hold elements.
+ */
+typedef struct q_slab {
+    size_t refs;
+    struct list_head link;
+} q_slab_t;
+
+/**
+ * q_arena_t - Chunks the elements of an arena-backed queue come from
+ * @chunks: list of the q_slab_t chunks still holding elements, newest first
+ * @next: first free byte in the newest chunk
+ * @left: number of free bytes at @next
+ * @chunk_size: size of the newest chunk; each new chunk doubles it, up to a
+ *              limit
+ * @mixed: set once elements from other queues were merged in
+ */
+typedef struct {
+    struct list_head chunks;
+    char *next;
+    size_t left;
+    size_t chunk_size;
+    bool mixed;
+} q_arena_t;
+
+/* Number of element pointers in each chunk of an unrolled queue */
+#define Q_CHUNK_SLOTS 64
+
+/**
+ * q_chunk_t - Block of element pointers of an unrolled queue
+ * @link: node in the list of chunks of the queue
+ * @begin: index of the first slot in use
+ * @end: index past the last slot in use
+ * @slot: elements of the queue, in queue order
+ */
+typedef struct {
+    struct list_head link;
+    int begin, end;
+    element_t *slot[Q_CHUNK_SLOTS];
+} q_chunk_t;
+
+/**
+ * queue_head_t - Header of a queue created by q_new()
+ * @head: head of the circular doubly-linked list
+ * @size: the number of elements linked after @head
+ * @track_mid: whether @mid is maintained, fixed by q_track_mid at q_new()
+ * @mid: the middle node, at index (@size - 1) / 2, or %NULL if unknown
+ * @mid_index: index of @mid
+ * @use_arena: whether elements come from @arena, fixed by q_arena at q_new()
+ * @arena: chunks backing the elements if @use_arena is set
+ * @intern: whether elements point into the string pool, fixed by q_intern at
+ *          q_new() unless @use_arena is set, and cleared once q_merge()
+ *          brings in elements of a queue that does not intern
+ * @unrolled: whether @chunks is maintained, fixed by q_unrolled at q_new()
+ * @chunks_valid: whether @chunks lists exactly the elements of the queue
+ * @chunks: list of q_chunk_t holding the elements in queue order
+ * @use_ring: whether @ring is maintained, fixed by q_ring at q_new()
+ * @ring_valid: whether @ring lists exactly the elements of the queue
+ * @ring: circular array of @ring_cap element pointers, in queue order
+ * @ring_first: index in @ring of the element at the head
+ * @ring_len: number of elements in @ring
+ * @ring_cap: size of @ring, a power of two, or 0 before it is allocated
+ *
+ * q_new() hands out a pointer to @head, so the queue API keeps taking plain
+ * struct list_head pointers. Every operation that adds or removes elements
+ * keeps @size up to date, which makes q_size() constant time.
+ *
+ * When @track_mid is set, insertions and removals at either end and
+ * q_delete_mid() move @mid along, which makes q_delete_mid() constant time
+ * amortized. Other operations reorder too much to follow and reset @mid to
+ * %NULL; q_delete_mid() then finds the middle again.
+ *
+ * When @use_arena is set, inserted elements are carved out of per-queue
+ * chunks instead of being allocated one by one. They are still released
+ * individually by q_release_element(), but q_free() drops whole chunks when
+ * every element they hold is still in the queue.
+ *
+ * When @intern is set, equal strings share one reference-counted copy, so
+ * q_delete_dup() compares pointers instead of strings.
+ *
+ * When @unrolled is set, the queue also keeps its elements in chunks of
+ * %Q_CHUNK_SLOTS pointers, so that scans through q_iter_first() read
+ * consecutive pointers and positional lookups skip whole chunks. The links
+ * stay authoritative: operations at either end and q_delete_mid() update the
+ * chunks as they go, the others clear @chunks_valid and the chunks are laid
+ * out again when next needed.
+ *
+ * @use_ring works the same way with a growable circular array instead of
+ * chunks, so that any position is found by index arithmetic. q_reverse(),
+ * q_reverseK() and q_sort() keep it in step as well, the last one by writing
+ * the sorted order back into it. The array grows by doubling and is halved
+ * once less than a quarter full.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    bool track_mid;
+    struct list_head *mid;
+    int mid_index;
+    bool use_arena;
+    q_arena_t arena;
+    bool intern;
+    bool unrolled;
+    bool chunks_valid;
+    struct list_head chunks;
+    bool use_ring;
+    bool ring_valid;
+    element_t **ring;
+    unsigned ring_first;
+    unsigned ring_len;
+    unsigned ring_cap;
+} queue_head_t;
+
+/**
+ * q_head() - Get the header of a queue created by q_new()
+ * @head: header of queue
+ *
+ * Return: the queue_head_t embedding @head
+ */
+static inline queue_head_t *q_head(struct list_head *head)
+{
+    return list_entry(head, queue_head_t, head);
+}
+
+/* Non-zero to allocate each element and its string as a single block */
+extern int q_inline_value;
+
+/* Bytes of inline storage in each element when q_sso is set, so that strings
+ * of up to Q_SSO_SIZE - 1 characters need no allocation of their own
+ */
+#define Q_SSO_SIZE 24
+
+/* Non-zero to allocate fixed-size elements with a small inline buffer,
+ * overrides q_inline_value
+ */
+extern int q_sso;
+
+/* Queues at least this long are sorted through an array of prefix keys,
+ * 0 (the default) disables it. The array is allocated while q_sort() runs,
+ * so qtest then checks that the sort frees whatever it allocates instead of
+ * forbidding allocation.
+ */
+extern int q_keysort_threshold;
+
+/* Non-zero to sort with MSD radix sort instead of merge sort */
+extern int q_radix_sort;
+
+/* Number of threads q_sort() may use on large queues */
+extern int q_sort_threads;
+
+/* Number of threads q_merge() may use for the pairwise merges of a round */
+extern int q_merge_threads;
+
+/* Non-zero to have queues created by q_new() track their middle node */
+extern int q_track_mid;
+
+/* Non-zero for q_ascend()/q_descend() to compare cached 8-byte string
+ * prefixes before falling back to strcmp()
+ */
+extern int q_prefix_compare;
+
+/* Non-zero to back queues created by q_new() with an arena */
+extern int q_arena;
+
+/* Non-zero to have queues created by q_new() share equal strings through a
+ * pool, unless they use an arena
+ */
+extern int q_intern;
+
+/* Number of distinct strings in the pool */
+extern size_t q_interned;
+
+/* Non-zero to have queues created by q_new() keep their elements in chunks
+ * as well, see queue_head_t
+ */
+extern int q_unrolled;
+
+/* Non-zero to have queues created by q_new() keep their elements in a ring
+ * buffer as well, overrides q_unrolled
+ */
+extern int q_ring;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -51,6 +265,9 @@ struct list_head *q_new();
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
+ *
+ * An arena-backed queue whose chunks hold nothing but its own elements is
+ * released chunk by chunk, in time independent of its length.
  */
 void q_free(struct list_head *head);
 
@@ -78,6 +295,34 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert several elements in the head at once
+ * @head: header of queue
+ * @s: array of the strings would be inserted
+ * @n: number of strings in @s
+ *
+ * The result is the same as calling q_insert_head() on each string of @s in
+ * turn, so @s[n - 1] ends up first. All elements are carved out of a single
+ * slab allocation, linked privately and spliced into the queue once. A
+ * string may appear in @s several times to insert it repeatedly.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_bulk(struct list_head *head, char *const s[], int n);
+
+/**
+ * q_insert_tail_bulk() - Insert several elements at the tail at once
+ * @head: header of queue
+ * @s: array of the strings would be inserted
+ * @n: number of strings in @s
+ *
+ * The result is the same as calling q_insert_tail() on each string of @s in
+ * turn. Elements are allocated as in q_insert_head_bulk().
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_bulk(struct list_head *head, char *const s[], int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,22 +353,199 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_head_view() - Remove the element from head of queue without
+ *                        copying its string
+ * @head: header of queue
+ * @view: set to the removed element's string
+ * @len: if not NULL, set to the length of *@view
+ *
+ * Unlike q_remove_head(), nothing is copied: *@view is borrowed from the
+ * returned element and stays valid until it is released.
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_remove_head_view(struct list_head *head,
+                              const char **view,
+                              size_t *len);
+
+/**
+ * q_remove_tail_view() - Remove the element from tail of queue without
+ *                        copying its string
+ * @head: header of queue
+ * @view: set to the removed element's string
+ * @len: if not NULL, set to the length of *@view
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_remove_tail_view(struct list_head *head,
+                              const char **view,
+                              size_t *len);
+
+/**
+ * q_remove_head_n() - Remove up to n elements from head of queue at once
+ * @head: header of queue
+ * @n: number of elements to remove
+ * @out: list head which receives the removed elements
+ *
+ * The first @n elements, or all of them if the queue is shorter, are cut off
+ * in one operation and linked after @out in queue order. @out is
+ * (re)initialized first, so it may be uninitialized on entry. No string is
+ * copied; the caller owns the detached elements and releases them with
+ * q_release_element().
+ *
+ * Finding the cutting point walks from the nearer end of the queue, the cut
+ * itself takes constant time.
+ *
+ * Return: the number of elements moved to @out, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *out);
+
+/**
+ * q_remove_tail_n() - Remove up to n elements from tail of queue at once
+ * @head: header of queue
+ * @n: number of elements to remove
+ * @out: list head which receives the removed elements
+ *
+ * Like q_remove_head_n(), but takes the last @n elements. They keep their
+ * queue order in @out, so the old tail ends up last.
+ *
+ * Return: the number of elements moved to @out, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head, int n, struct list_head *out);
+
+/**
+ * q_element_is_inline() - Check whether the string shares the element's block
+ * @e: element to inspect
+ *
+ * Return: true if @e->value points to @e->inline_value
+ */
+static inline bool q_element_is_inline(const element_t *e)
+{
+    return e->layout == Q_ELEMENT_INLINE;
+}
+
+/**
+ * q_element_slab() - Get the slab an element was allocated from
+ * @e: element to inspect
+ *
+ * Return: the slab holding @e, %NULL if @e was allocated on its own
+ */
+static inline q_slab_t *q_element_slab(const element_t *e)
+{
+    q_slab_t *slab = NULL;
+    if (e->layout == Q_ELEMENT_SLAB || e->layout == Q_ELEMENT_INTERN)
+        memcpy(&slab, e->inline_value, sizeof(slab));
+    return slab;
+}
+
+/**
+ * q_intern_put() - Drop a reference to a pooled string
+ * @s: string an element pointed to
+ *
+ * The pooled copy is freed along with its last reference.
+ *
+ * This function is intended for internal use only.
+ *
+ * Return: true if @s belongs to the pool, false otherwise
+ */
+bool q_intern_put(const char *s);
+
+/**
+ * q_iter_t - Position of a walk through a queue
+ * @head: header of the queue
+ * @node: current node when walking the links
+ * @chunk: current chunk when walking the chunks, %NULL otherwise
+ * @slot: index of the current element in @chunk
+ * @ring: the ring when walking it, %NULL otherwise
+ * @pos: index of the current element in @ring
+ * @mask: capacity of @ring minus one
+ * @left: number of elements from the current one to the tail
+ */
+typedef struct {
+    struct list_head *head;
+    struct list_head *node;
+    q_chunk_t *chunk;
+    int slot;
+    element_t **ring;
+    unsigned pos, mask;
+    unsigned left;
+} q_iter_t;
+
+/**
+ * q_iter_first() - Start walking a queue from head to tail
+ * @head: header of queue
+ * @it: position to initialize
+ *
+ * A ring or unrolled queue is walked through its ring or chunks, laying them
+ * out first if they are stale. Other queues, or one whose ring or chunks
+ * cannot be allocated, are walked through their links. The queue must not
+ * change during the walk.
+ *
+ * Return: the first element, %NULL if the queue is empty
+ */
+element_t *q_iter_first(struct list_head *head, q_iter_t *it);
+
+/**
+ * q_iter_next() - Step to the next element of a walk
+ * @it: position set up by q_iter_first()
+ *
+ * Return: the next element, %NULL past the tail of the queue
+ */
+static inline element_t *q_iter_next(q_iter_t *it)
+{
+    if (it->ring) {
+        if (!--it->left)
+            return NULL;
+        it->pos = (it->pos + 1) & it->mask;
+        return it->ring[it->pos];
+    }
+    if (it->chunk) {
+        if (++it->slot == it->chunk->end) {
+            struct list_head *next = it->chunk->link.next;
+            if (next == &q_head(it->head)->chunks)
+                return NULL;
+            it->chunk = list_entry(next, q_chunk_t, link);
+            it->slot = it->chunk->begin;
+        }
+        return it->chunk->slot[it->slot];
+    }
+    it->node = it->node->next;
+    return it->node == it->head ? NULL : list_entry(it->node, element_t, list);
+}
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * All layouts are handled: a separately allocated string is freed first, an
+ * inline string goes away together with the element, a pooled string loses
+ * a reference, and an element of a slab only frees the slab once it is the
+ * last one left.
+ *
  * This function is intended for internal use only.
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
-    test_free(e);
+    q_slab_t *slab = q_element_slab(e);
+    if (e->layout == Q_ELEMENT_SEPARATE)
+        test_free(e->value);
+    else if (e->layout == Q_ELEMENT_INTERN)
+        q_intern_put(e->value);
+    if (!slab)
+        test_free(e);
+    else if (!--slab->refs) {
+        list_del(&slab->link);
+        test_free(slab);
+    }
 }
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The length is cached in the queue header, so this takes constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -136,6 +558,9 @@ int q_size(struct list_head *head);
  * ⌊n / 2⌋th node from the start using 0-based indexing.
  * If there're six elements, the third member should be deleted.
  *
+ * Queues tracking their middle node (see queue_head_t) take constant time
+ * amortized, others walk to it from the head in about n / 2 steps.
+ *
  * Reference:
  * https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
  *
@@ -155,6 +580,21 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_hash() - Delete all nodes whose string appears more than once
+ *                       anywhere in the queue, keeping the order of the rest.
+ * @head: header of queue
+ *
+ * Unlike q_delete_dup(), the queue does not have to be sorted. Strings are
+ * counted in an open-addressing hash table sized from the queue length, so
+ * this takes O(n) expected time. The queue is left untouched if the table
+ * cannot be allocated.
+ *
+ * Return: true for success, false if list is NULL or empty, or if allocation
+ * failed.
+ */
+bool q_delete_dup_hash(struct list_head *head);
+
 /**
  * q_swap() - Swap every two adjacent nodes
  * @head: header of queue
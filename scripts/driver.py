@@ -35,7 +35,21 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-perf",
+        19: "trace-19-perf",
+        20: "trace-20-hdedup",
+        21: "trace-21-removen",
+        22: "trace-22-view",
+        23: "trace-23-trackmid",
+        24: "trace-24-arena",
+        25: "trace-25-sso",
+        26: "trace-26-intern",
+        27: "trace-27-unrolled",
+        28: "trace-28-radix",
+        29: "trace-29-sortthreads",
+        30: "trace-30-quarantine",
+        31: "trace-31-allocprof"
     }
 
     traceProbs = {
@@ -55,10 +69,27 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces with no points exercise optional features: they report ok or
+    # FAIL and fail the run, but leave the total at 100
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 0, 0, 0,
+                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,13 +100,15 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 backend=""):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.backend = backend
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -89,6 +122,8 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.backend != "":
+            clist += ["-b", self.backend]
 
         try:
             retcode = subprocess.call(clist)
@@ -109,6 +144,7 @@ class Tracer:
             tidList = [tid]
         score = 0
         maxscore = 0
+        failed = False
         if self.useValgrind:
             self.command = ['valgrind', self.qtest]
         else:
@@ -119,6 +155,11 @@ class Tracer:
                 print("+++ TESTING trace %s:" % tname)
             ok = self.runTrace(t)
             maxval = self.maxScores[t]
+            if maxval == 0:
+                color = self.GREEN if ok else self.RED
+                self.printInColor("---\t%s\t%s" % (tname, "ok" if ok else "FAIL"), color)
+                failed = failed or not ok
+                continue
             tval = maxval if ok else 0
             if tval < maxval:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
@@ -142,15 +183,16 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        if score < maxscore or failed:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v LEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v LEVEL] [-b BACKEND] [--valgrind] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v LEVEL  Set verbosity level (0-3)")
+    print("  -b BACKEND  Queue backend: 'list', 'unrolled' or 'ring'")
     print("  -c Enable colored text")
     sys.exit(0)
 
@@ -163,8 +205,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    backend = ""
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:b:A:c', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -175,6 +218,8 @@ def run(name, args):
         elif opt == '-v':
             vlevel = int(val)
             levelFixed = True
+        elif opt == '-b':
+            backend = val
         elif opt == '-A':
             autograde = True
         elif opt == '--valgrind':
@@ -190,7 +235,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               backend=backend)
     t.run(tid)
 
 
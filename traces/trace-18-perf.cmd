@@ -0,0 +1,12 @@
+# Test performance of 'q_reverseK' with small, medium and large groups
+option fail 0
+option malloc 0
+option bulk 1
+new
+ih RAND 1000000
+reverseK 2
+reverseK 64
+reverseK 4096
+reverseK 4096
+reverseK 64
+reverseK 2
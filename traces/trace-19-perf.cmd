@@ -0,0 +1,42 @@
+# Test performance of 'q_ascend' and 'q_descend' on large queues, with and without 'option prefixcmp'
+option fail 0
+option malloc 0
+new
+it meerkat 400000
+it gerbil 400000
+it aardvark_cat 400000
+it aardvark_bear 400000
+ascend
+free
+new
+it aardvark_bear 400000
+it aardvark_cat 400000
+it gerbil 400000
+it meerkat 400000
+descend
+free
+new
+ih RAND 500000
+ascend
+descend
+free
+option prefixcmp 1
+new
+it meerkat 400000
+it gerbil 400000
+it aardvark_cat 400000
+it aardvark_bear 400000
+ascend
+free
+new
+it aardvark_bear 400000
+it aardvark_cat 400000
+it gerbil 400000
+it meerkat 400000
+descend
+free
+new
+ih RAND 500000
+ascend
+descend
+free
@@ -0,0 +1,23 @@
+# Test of 'q_delete_dup_hash' on unsorted queues: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_delete_dup_hash'
+option fail 0
+option malloc 0
+new
+it gerbil
+it bear
+it dolphin
+it bear
+it meerkat
+it gerbil
+it tiger
+it bear
+hdedup
+rh dolphin
+rh meerkat
+rh tiger
+ih vulture
+ih vulture
+ih vulture
+it lion
+hdedup
+rh lion
+free
@@ -0,0 +1,17 @@
+# Test of removing several nodes at once: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head_n', and 'q_remove_tail_n'
+option fail 0
+option malloc 0
+new
+it gerbil 5
+it bear 3
+ih tiger 2
+rh tiger 2
+rt bear 3
+rh gerbil 4
+it dolphin 6
+rt dolphin 6
+rh gerbil 1
+ih meerkat 3
+rt meerkat 10
+size
+free
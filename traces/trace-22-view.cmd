@@ -0,0 +1,16 @@
+# Test of 'option view': 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head_view', and 'q_remove_tail_view'
+option fail 0
+option malloc 0
+option view 1
+new
+ih gerbil
+ih bear
+it dolphin
+it meerkat
+rh bear
+rt meerkat
+it a_string_long_enough_to_need_its_own_block
+rt a_string_long_enough_to_need_its_own_block
+rh gerbil
+rh dolphin
+free
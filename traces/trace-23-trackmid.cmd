@@ -0,0 +1,25 @@
+# Test of 'option trackmid': 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', 'q_delete_mid', 'q_reverse', and 'q_sort'
+option fail 0
+option malloc 0
+option trackmid 1
+new
+it a
+it b
+it c
+it d
+it e
+dm
+rh a
+ih z
+dm
+rt e
+it f
+it g
+dm
+reverse
+dm
+sort
+rh g
+rh z
+size
+free
@@ -0,0 +1,27 @@
+# Test of 'option arena': 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_delete_mid', 'q_sort', and 'q_merge'
+option fail 0
+option malloc 0
+option arena 1
+new
+it gerbil
+it bear
+ih dolphin
+it meerkat 100
+dm
+rh dolphin
+sort
+option arena 0
+new
+it aardvark
+it zebra
+option arena 1
+new
+it cat 50
+merge
+rh aardvark
+rh bear
+rh cat 50
+rh gerbil
+rh meerkat 99
+rh zebra
+free
@@ -0,0 +1,24 @@
+# Test of 'option sso' with short and long strings: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', 'q_sort', and 'q_merge'
+option fail 0
+option malloc 0
+option sso 1
+new
+it bear
+it a_string_longer_than_the_inline_storage
+ih twenty_three_bytes_long
+ih twenty_four_bytes_long__
+sort
+rh a_string_longer_than_the_inline_storage
+rh bear
+rh twenty_four_bytes_long__
+rt twenty_three_bytes_long
+option sso 0
+new
+it zebra_whose_name_is_also_rather_long
+option sso 1
+new
+it gerbil
+merge
+rh gerbil
+rh zebra_whose_name_is_also_rather_long
+free
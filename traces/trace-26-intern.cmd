@@ -0,0 +1,33 @@
+# Test of 'option intern' with strings shared across queues: 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_delete_dup', 'q_sort', and 'q_merge'
+option fail 0
+option malloc 0
+option intern 1
+new
+it gerbil
+it bear
+it gerbil
+it tiger
+sort
+new
+it bear
+it dolphin
+it bear
+sort
+option intern 0
+new
+it meerkat
+it bear
+sort
+merge
+dedup
+rh dolphin
+rh meerkat
+rh tiger
+option intern 1
+new
+ih gerbil
+ih gerbil
+rh gerbil
+rh gerbil
+free
+free
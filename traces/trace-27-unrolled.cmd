@@ -0,0 +1,33 @@
+# Test of 'option unrolled': 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', 'q_delete_mid', 'q_reverse', 'q_reverseK', 'q_swap', and 'q_sort'
+option fail 0
+option malloc 0
+option unrolled 1
+new
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+it h
+it i
+it j
+ih z
+dm
+reverse
+reverseK 3
+swap
+rh i
+rh h
+rh d
+rt c
+sort
+rh a
+rh b
+rh f
+rt z
+rt j
+rh g
+size
+free
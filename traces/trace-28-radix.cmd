@@ -0,0 +1,33 @@
+# Test of 'option radix' with shared prefixes: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_sort'
+option fail 0
+option malloc 0
+option radix 1
+new
+it bear
+it be
+it bearcat
+it b
+it bear
+it aardvark
+it beaver
+it b
+ih zebra
+sort
+rh aardvark
+rh b
+rh b
+rh be
+rh bear
+rh bear
+rh bearcat
+rh beaver
+rh zebra
+it gerbil 40
+it dolphin 40
+it gerbilus 40
+option descend 1
+sort
+rh gerbilus 40
+rh gerbil 40
+rh dolphin 40
+free
@@ -0,0 +1,23 @@
+# Test of 'option sortthreads' on queues large enough to split: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_sort'
+option fail 0
+option malloc 0
+option sortthreads 4
+new
+it meerkat 6000
+it bear 6000
+ih gerbil 6000
+it aardvark 6000
+sort
+rh aardvark 6000
+rh bear 6000
+rh gerbil 6000
+rh meerkat 6000
+it gerbil 5000
+it dolphin 5000
+it bear 5000
+option descend 1
+sort
+rh gerbil 5000
+rh dolphin 5000
+rh bear 5000
+free
@@ -0,0 +1,21 @@
+# Test of 'option quarantine' and that it reports a write to a freed block: 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', 'q_reverse', and 'q_sort'
+option fail 0
+option malloc 0
+option quarantine 64
+new
+it gerbil 100
+ih bear 100
+rh bear 50
+rt gerbil 80
+reverse
+sort
+rh bear 50
+rh gerbil 20
+it dolphin
+rh dolphin
+scribble
+free
+new
+ih tiger 200
+free
+option quarantine 0
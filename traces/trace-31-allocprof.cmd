@@ -0,0 +1,19 @@
+# Test of 'option allocprof' and that nothing is live after 'free': 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_sort'
+option fail 0
+option malloc 0
+option allocprof 1
+new
+it gerbil 30
+ih a_string_long_enough_to_need_a_larger_block 10
+rh a_string_long_enough_to_need_a_larger_block 10
+sort
+allocprof
+rh gerbil 30
+free
+allocprof 0
+new
+it bear 10
+allocprof
+free
+allocprof 0
+option allocprof 0
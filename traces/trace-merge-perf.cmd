@@ -0,0 +1,57 @@
+# Benchmark 'q_merge' on 16 queues of 100000 elements each, for comparing
+# 'option mergethreads' settings; not part of the graded traces
+option fail 0
+option malloc 0
+option timelimit 10
+option inline 1
+option mergethreads 4
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+ih RAND 100000
+sort
+time merge
+free
@@ -0,0 +1,8 @@
+# Test if time complexity of 'q_insert_tail', 'q_insert_head', 'q_remove_tail', and 'q_remove_head' is constant with the ring buffer backend; not run by the driver, as it times a backend that is optional
+option ring 1
+option simulation 1
+it
+ih
+rh
+rt
+option simulation 0